@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <list>
+#include <stdexcept>
+
+// Bigger blocks compress better, smaller blocks are committed sooner
+static const size_t archive_block_size = 1024 * 1024;
+static const size_t tar_block_size = 512;
+
+// Same as for other paths, metadata of archive file itself must be on disk before any file is removed
+static void sync_parent_directory(const std::string &filename)
+{
+	size_t pos = filename.rfind('/');
+	const std::string directory = (pos == std::string::npos) ? std::string(".") : ((pos == 0) ? std::string("/") : filename.substr(0, pos));
+
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if ((fd < 0) || (fsync(fd) < 0))
+	{
+		fprintf(stderr, "Failed to sync directory containing file: %s\n", filename.c_str());
+	}
+
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+}
+
+// Numbers which don't fit into octal field are stored in base-256 format, same as GNU tar does
+static void format_number(char *field, size_t length, uint64_t value)
+{
+	if ((length * 3 - 3 >= 64) || (value < (static_cast<uint64_t>(1) << ((length - 1) * 3))))
+	{
+		snprintf(field, length, "%0*llo", static_cast<int>(length - 1), static_cast<unsigned long long>(value));
+	}
+	else
+	{
+		memset(field, 0, length);
+		field[0] = static_cast<char>(0x80);
+
+		for (size_t i = length - 1; (i > 0) && (value != 0); --i)
+		{
+			field[i] = static_cast<char>(value & 0xFF);
+			value >>= 8;
+		}
+	}
+}
+
+static bool compress_block(const std::vector<char> &input, std::vector<char> &output)
+{
+	z_stream stream;
+
+	memset(&stream, 0, sizeof(stream));
+
+	// window bits over 15 produce gzip header and trailer
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	output.resize(deflateBound(&stream, input.size()));
+
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+	stream.avail_in = input.size();
+	stream.next_out = reinterpret_cast<Bytef*>(output.data());
+	stream.avail_out = output.size();
+
+	int result = deflate(&stream, Z_FINISH);
+
+	output.resize(output.size() - stream.avail_out);
+	deflateEnd(&stream);
+
+	return (result == Z_STREAM_END);
+}
+
+archive_writer::archive_writer(const std::string &filename, unsigned int threads)
+	: m_filename(filename),
+	m_fd(-1),
+	m_block_sequence(1),
+	m_entries(0),
+	m_submitted_sequence(0),
+	m_committed_sequence(0),
+	m_bytes_written(0),
+	m_failed(false),
+	m_finishing(false),
+	m_threads((threads > 0) ? threads : 1)
+{
+	m_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (m_fd < 0)
+	{
+		throw std::runtime_error("Failed to create file: " + filename);
+	}
+
+	sync_parent_directory(filename);
+
+	m_block.reserve(archive_block_size);
+
+	for (unsigned int i = 0; i < m_threads; ++i)
+	{
+		m_compressors.emplace_back(&archive_writer::compressor, this);
+	}
+
+	m_writer = std::thread(&archive_writer::writer, this);
+}
+
+archive_writer::~archive_writer()
+{
+	if (m_writer.joinable())
+	{
+		finish();
+	}
+}
+
+bool archive_writer::append(const std::string &path, uint64_t &ticket)
+{
+	struct stat buffer;
+
+	if (lstat(path.c_str(), &buffer) == -1)
+	{
+		fprintf(stderr, "Failed to archive file: %s\n", path.c_str());
+		return false;
+	}
+
+	std::string name = path.substr(path.find_first_not_of('/') == std::string::npos ? path.length() : path.find_first_not_of('/'));
+	std::string link_name;
+	int fd = -1;
+
+	if (S_ISDIR(buffer.st_mode))
+	{
+		name.append("/");
+	}
+	else if (S_ISLNK(buffer.st_mode))
+	{
+		std::vector<char> target(buffer.st_size + 1, '\0');
+		ssize_t length = readlink(path.c_str(), target.data(), target.size());
+
+		if ((length < 0) || (static_cast<size_t>(length) >= target.size()))
+		{
+			fprintf(stderr, "Failed to archive file: %s\n", path.c_str());
+			return false;
+		}
+
+		link_name.assign(target.data(), length);
+	}
+	else if (S_ISREG(buffer.st_mode))
+	{
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			fprintf(stderr, "Failed to archive file: %s\n", path.c_str());
+			return false;
+		}
+	}
+	else
+	{
+		fprintf(stderr, "Failed to archive file of unsupported type: %s\n", path.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_append_mutex);
+
+	{
+		std::lock_guard<std::mutex> state_lock(m_mutex);
+
+		if (m_failed)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+
+			return false;
+		}
+	}
+
+	bool result = true;
+
+	if (fd >= 0)
+	{
+		uint64_t size = buffer.st_size;
+		uint64_t left = size;
+		char data[65536];
+
+		write_header(name, '0', buffer, size, link_name);
+
+		while (left > 0)
+		{
+			ssize_t length = read(fd, data, std::min<uint64_t>(left, sizeof(data)));
+
+			if (length < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				result = false;
+				break;
+			}
+			else if (length == 0)
+			{
+				// file is truncated while being read
+				result = false;
+				break;
+			}
+
+			write_data(data, length);
+			left -= length;
+		}
+
+		close(fd);
+
+		// archive must stay valid, so header size is kept
+		if (!result)
+		{
+			memset(data, 0, sizeof(data));
+
+			while (left > 0)
+			{
+				size_t length = std::min<uint64_t>(left, sizeof(data));
+
+				write_data(data, length);
+				left -= length;
+			}
+
+			fprintf(stderr, "Failed to archive file: %s\n", path.c_str());
+		}
+
+		pad_data(size);
+	}
+	else
+	{
+		write_header(name, S_ISDIR(buffer.st_mode) ? '5' : '2', buffer, 0, link_name);
+	}
+
+	++m_entries;
+
+	// if block ended exactly at the end of this entry, it's already submitted
+	ticket = m_block.empty() ? (m_block_sequence - 1) : m_block_sequence;
+
+	return result;
+}
+
+bool archive_writer::commit(uint64_t ticket)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_append_mutex);
+
+		if ((ticket == m_block_sequence) && (!m_block.empty()))
+		{
+			submit_block();
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_cond.wait(lock, [this, ticket]() { return (m_committed_sequence >= ticket) || m_failed; });
+
+	return (m_committed_sequence >= ticket);
+}
+
+bool archive_writer::committed(uint64_t ticket)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return (m_committed_sequence >= ticket);
+}
+
+bool archive_writer::finish()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_append_mutex);
+		char end_of_archive[tar_block_size * 2];
+
+		memset(end_of_archive, 0, sizeof(end_of_archive));
+		write_data(end_of_archive, sizeof(end_of_archive));
+
+		submit_block();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_finishing = true;
+		m_cond.notify_all();
+	}
+
+	for (auto iter = m_compressors.begin(); iter != m_compressors.end(); ++iter)
+	{
+		iter->join();
+	}
+
+	m_writer.join();
+
+	bool result = (!m_failed);
+
+	if (close(m_fd) < 0)
+	{
+		result = false;
+	}
+
+	m_fd = -1;
+
+	if (!result)
+	{
+		fprintf(stderr, "Failed to write file: %s\n", m_filename.c_str());
+	}
+
+	return result;
+}
+
+const std::string& archive_writer::filename() const
+{
+	return m_filename;
+}
+
+uint64_t archive_writer::entries() const
+{
+	return m_entries;
+}
+
+uint64_t archive_writer::bytes_written() const
+{
+	return m_bytes_written;
+}
+
+// Names and link targets longer than header fields are stored in preceding GNU extension entries
+void archive_writer::write_long_name(const std::string &name, char type)
+{
+	struct stat buffer;
+
+	memset(&buffer, 0, sizeof(buffer));
+
+	write_header("././@LongLink", type, buffer, name.length() + 1, std::string());
+	write_data(name.c_str(), name.length() + 1);
+	pad_data(name.length() + 1);
+}
+
+void archive_writer::write_header(const std::string &name, char type, const struct stat &buffer, uint64_t size, const std::string &link_name)
+{
+	char header[tar_block_size];
+
+	if (name.length() > 100)
+	{
+		write_long_name(name, 'L');
+	}
+
+	if (link_name.length() > 100)
+	{
+		write_long_name(link_name, 'K');
+	}
+
+	memset(header, 0, sizeof(header));
+
+	memcpy(header, name.c_str(), std::min<size_t>(name.length(), 100));
+	format_number(header + 100, 8, buffer.st_mode & 07777);
+	format_number(header + 108, 8, buffer.st_uid);
+	format_number(header + 116, 8, buffer.st_gid);
+	format_number(header + 124, 12, size);
+	format_number(header + 136, 12, (buffer.st_mtime > 0) ? buffer.st_mtime : 0);
+	header[156] = type;
+	memcpy(header + 157, link_name.c_str(), std::min<size_t>(link_name.length(), 100));
+	memcpy(header + 257, "ustar  ", 8);
+
+	// checksum is calculated with checksum field filled with spaces
+	unsigned int checksum = 0;
+
+	memset(header + 148, ' ', 8);
+
+	for (size_t i = 0; i < sizeof(header); ++i)
+	{
+		checksum += static_cast<unsigned char>(header[i]);
+	}
+
+	snprintf(header + 148, 7, "%06o", checksum);
+
+	write_data(header, sizeof(header));
+}
+
+void archive_writer::write_data(const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		size_t length = std::min(size, archive_block_size - m_block.size());
+
+		m_block.insert(m_block.end(), data, data + length);
+		data += length;
+		size -= length;
+
+		if (m_block.size() == archive_block_size)
+		{
+			submit_block();
+		}
+	}
+}
+
+void archive_writer::pad_data(uint64_t size)
+{
+	static const char zeroes[tar_block_size] = { 0 };
+
+	if (size % tar_block_size != 0)
+	{
+		write_data(zeroes, tar_block_size - size % tar_block_size);
+	}
+}
+
+void archive_writer::submit_block()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// don't let uncompressed data pile up if compression or disk is slower than reading
+	m_cond.wait(lock, [this]() { return (m_submitted_sequence - m_committed_sequence < m_threads * 2) || m_failed; });
+
+	m_pending_blocks.push_back(std::make_pair(m_block_sequence, std::move(m_block)));
+	m_submitted_sequence = m_block_sequence;
+	++m_block_sequence;
+	m_cond.notify_all();
+
+	lock.unlock();
+
+	m_block = std::vector<char>();
+	m_block.reserve(archive_block_size);
+}
+
+void archive_writer::compressor()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	for (;;)
+	{
+		m_cond.wait(lock, [this]() { return (!m_pending_blocks.empty()) || m_finishing || m_failed; });
+
+		if (m_pending_blocks.empty() || m_failed)
+		{
+			break;
+		}
+
+		std::pair<uint64_t, std::vector<char> > block = std::move(m_pending_blocks.front());
+		m_pending_blocks.pop_front();
+
+		lock.unlock();
+
+		std::vector<char> output;
+		bool compressed = compress_block(block.second, output);
+
+		lock.lock();
+
+		if (!compressed)
+		{
+			m_failed = true;
+		}
+
+		m_compressed_blocks[block.first] = std::move(output);
+		m_cond.notify_all();
+	}
+}
+
+// Writes compressed blocks in order. Everything available is written at once and synced to disk with single call
+void archive_writer::writer()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	for (;;)
+	{
+		m_cond.wait(lock, [this]()
+		{
+			return (m_compressed_blocks.find(m_committed_sequence + 1) != m_compressed_blocks.end())
+				|| (m_finishing && (m_committed_sequence == m_submitted_sequence))
+				|| m_failed;
+		});
+
+		if (m_failed || (m_compressed_blocks.find(m_committed_sequence + 1) == m_compressed_blocks.end()))
+		{
+			break;
+		}
+
+		std::list<std::vector<char> > blocks;
+		uint64_t last_sequence = m_committed_sequence;
+
+		for (auto iter = m_compressed_blocks.find(last_sequence + 1); (iter != m_compressed_blocks.end()) && (iter->first == last_sequence + 1); iter = m_compressed_blocks.erase(iter))
+		{
+			blocks.push_back(std::move(iter->second));
+			++last_sequence;
+		}
+
+		lock.unlock();
+
+		bool failed = false;
+		uint64_t written = 0;
+
+		for (auto iter = blocks.begin(); (iter != blocks.end()) && (!failed); ++iter)
+		{
+			size_t offset = 0;
+
+			while (offset < iter->size())
+			{
+				ssize_t length = write(m_fd, iter->data() + offset, iter->size() - offset);
+
+				if (length < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+
+					failed = true;
+					break;
+				}
+
+				offset += length;
+			}
+
+			written += offset;
+		}
+
+		if ((!failed) && (fdatasync(m_fd) < 0))
+		{
+			failed = true;
+		}
+
+		lock.lock();
+
+		m_bytes_written += written;
+
+		if (failed)
+		{
+			m_failed = true;
+		}
+		else
+		{
+			m_committed_sequence = last_sequence;
+		}
+
+		m_cond.notify_all();
+	}
+
+	m_cond.notify_all();
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DT_KERNEL_CLEANER_ARCHIVE_H
+#define DT_KERNEL_CLEANER_ARCHIVE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes tar archive compressed with gzip. Archive is split into blocks which are compressed in parallel
+// as separate gzip members and written to file in order, so result may be read by usual tar and gzip.
+// Each appended entry gets a ticket, and once commit() of that ticket succeeds,
+// entry data is written to archive file and is on disk, so original file may be removed.
+// Archive is only valid after finish(), but everything committed before failure or interruption may still be extracted
+class archive_writer
+{
+public:
+	// Archive file must not exist yet
+	archive_writer(const std::string &filename, unsigned int threads);
+	~archive_writer();
+
+	archive_writer(const archive_writer &other) = delete;
+	archive_writer& operator=(const archive_writer &other) = delete;
+
+	// Appends regular file, symlink or directory. Paths are stored without leading '/'.
+	// These may be called from multiple threads
+	bool append(const std::string &path, uint64_t &ticket);
+	// Waits until entries up to ticket are on disk. Block being filled is written out early if ticket is in it
+	bool commit(uint64_t ticket);
+	// Checks without waiting if entries up to ticket are on disk
+	bool committed(uint64_t ticket);
+
+	// Writes end of archive, waits for all data to be written and closes file
+	bool finish();
+
+	const std::string& filename() const;
+	uint64_t entries() const;
+	uint64_t bytes_written() const;
+
+private:
+	void write_header(const std::string &name, char type, const struct stat &buffer, uint64_t size, const std::string &link_name);
+	void write_long_name(const std::string &name, char type);
+	void write_data(const char *data, size_t size);
+	void pad_data(uint64_t size);
+	void submit_block();
+
+	void compressor();
+	void writer();
+
+	std::string m_filename;
+	int m_fd;
+
+	// guards tar stream being built
+	std::mutex m_append_mutex;
+	std::vector<char> m_block;
+	uint64_t m_block_sequence;
+	uint64_t m_entries;
+
+	// guards everything below
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::pair<uint64_t, std::vector<char> > > m_pending_blocks;
+	std::map<uint64_t, std::vector<char> > m_compressed_blocks;
+	uint64_t m_submitted_sequence;
+	uint64_t m_committed_sequence;
+	uint64_t m_bytes_written;
+	bool m_failed;
+	bool m_finishing;
+
+	unsigned int m_threads;
+	std::vector<std::thread> m_compressors;
+	std::thread m_writer;
+};
+
+#endif /* DT_KERNEL_CLEANER_ARCHIVE_H */
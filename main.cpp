@@ -19,20 +19,41 @@
  */
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
 #include <functional>
 #include <list>
+#include <memory>
 #include <optional>
 #include <regex>
 #include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "archive.h"
+#include "metrics.h"
+#include "probes.h"
+#include "progress.h"
+#include "removal.h"
+
 const std::string directory_boot = "/boot";
 const std::string directory_modules = "/lib/modules";
 const std::string directory_src = "/usr/src";
@@ -45,6 +66,10 @@ const std::string prefix_boot_initramfs = "initramfs-";
 
 const std::string prefix_src = "linux-";
 
+// Checkpoint is trusted to contain only paths to remove, so it's kept where only root may write
+const std::string default_checkpoint_directory = "/var/lib/dt-kernel-cleaner";
+const std::string default_checkpoint_file = default_checkpoint_directory + "/checkpoint";
+
 const std::string regex_version = "\\d+(?:\\.\\d+)*";
 const std::string regex_revision_and_local_version = "(?:-|_)\\S+";
 
@@ -162,7 +187,21 @@ bool operator<(const version_info &a, const version_info &b)
 	}
 }
 
-std::set<std::string> list_files_in_directory(const std::string &location, const std::list<std::string> &filter_regex_string_list)
+bool name_has_any_prefix(const char *name, const std::set<std::string> &prefixes)
+{
+	for (auto iter = prefixes.begin(); iter != prefixes.end(); ++iter)
+	{
+		if (strncmp(name, iter->c_str(), iter->length()) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// If name_prefixes is not empty, only names starting with one of these prefixes are matched against regexes
+std::set<std::string> list_files_in_directory(const std::string &location, const std::list<std::string> &filter_regex_string_list, const std::set<std::string> &name_prefixes = std::set<std::string>())
 {
 	std::set<std::string> files;
 	struct stat buffer;
@@ -173,6 +212,8 @@ std::set<std::string> list_files_in_directory(const std::string &location, const
 		filter_regex_list.push_back(std::regex(*iter));
 	}
 
+	DT_KERNEL_CLEANER_PROBE1(scan_start, location.c_str());
+
 	if (stat(location.c_str(), &buffer) != -1)
 	{
 		if (S_ISDIR(buffer.st_mode))
@@ -197,6 +238,11 @@ std::set<std::string> list_files_in_directory(const std::string &location, const
 							continue;
 						}
 
+						if ((!name_prefixes.empty()) && (!name_has_any_prefix(dp->d_name, name_prefixes)))
+						{
+							continue;
+						}
+
 						for (auto iter = filter_regex_list.begin(); iter != filter_regex_list.end(); ++iter)
 						{
 							if (std::regex_match(dp->d_name, *iter))
@@ -218,52 +264,9 @@ std::set<std::string> list_files_in_directory(const std::string &location, const
 		}
 	}
 
-	return files;
-}
-
-void find_all_files_and_dirs(const std::string &location, std::set<std::string> &files, std::set<std::string> &directories)
-{
-	struct stat buffer;
-
-	if (lstat(location.c_str(), &buffer) != -1)
-	{
-		if (S_ISDIR(buffer.st_mode))
-		{
-			DIR *dirp;
-
-			directories.insert(location);
-
-			if ((dirp = opendir(location.c_str())) != NULL)
-			{
-				try
-				{
-					struct dirent *dp;
-
-					do
-					{
-						if ((dp = readdir(dirp)) != NULL)
-						{
-							if ((strcmp(dp->d_name, ".") != 0) && (strcmp(dp->d_name, "..") != 0))
-							{
-								find_all_files_and_dirs(location + "/" + std::string(dp->d_name), files, directories);
-							}
-						}
-					} while (dp != NULL);
-				}
-				catch (...)
-				{
-					closedir(dirp);
-					throw;
-				}
+	DT_KERNEL_CLEANER_PROBE2(scan_end, location.c_str(), files.size());
 
-				closedir(dirp);
-			}
-		}
-		else /* if (S_ISREG(buffer.st_mode) || S_ISLNK(buffer.st_mode)) */
-		{
-			files.insert(location);
-		}
-	}
+	return files;
 }
 
 std::vector<version_info_type> convertStringToVersion(const std::string &version_string)
@@ -289,625 +292,1833 @@ std::vector<version_info_type> convertStringToVersion(const std::string &version
 	return version_vector;
 }
 
-void remove_file(const std::string &file)
-{
-	if (unlink(file.c_str()) < 0)
-	{
-		fprintf(stderr, "Failed to remove file: %s\n", file.c_str());
-	}
-}
-
-void remove_directory(const std::string &directory)
-{
-	if (rmdir(directory.c_str()) < 0)
-	{
-		fprintf(stderr, "Failed to remove directory: %s\n", directory.c_str());
-	}
-}
-
 //       kernel version,                          kernel revision
-std::map<std::vector<version_info_type>, std::set<std::string>, VersionLess> kernel_src_versions;
+typedef std::map<std::vector<version_info_type>, std::set<std::string>, VersionLess> kernel_src_versions_map;
 //       kernel version,                          kernel revision,      kernel local version
-std::map<std::vector<version_info_type>, std::map<std::string, std::set<std::string> >, VersionLess> kernel_versions_tree;
+typedef std::map<std::vector<version_info_type>, std::map<std::string, std::set<std::string> >, VersionLess> kernel_versions_tree_map;
 
-void print_help(const char *name)
+struct cleaner_options
 {
-	fprintf(stderr,
-		   "USAGE: %s [options] kernel_version\n"
-		   "Options:\n"
-		   "\t[-h] --help - shows this info\n"
-		   "\t[-l] --list-only - list found kernel versions and exit. Do not specify kernel versions with this option\n"
-		   "\t[-v] --verbose - list found files and also print actions before executing them\n"
-		   "\t[-n] --dryrun - do not execute actions, only print them\n"
-		   "\t[-k] --keep-vmlinuzold - do not remove vmlinuz.old symlink if it becomes obsolete\n"
-		   "\t[-c] --clean-old - remove all kernels except the one currently running\n"
-		   "\t[-s] --keep-sources - keep sources even if no kernel is built out of those sources is present\n"
-		   "\n"
-		   "\tkernel version is in format d.d.d-revision or just d.d.d (number of digits is variable)\n",
-		   name);
-}
+	bool list_only = false;
+	bool verbose = false;
+	bool dry_run = false;
+	bool do_not_touch_vmlinuzold = false;
+	bool clean_old = false;
+	bool keep_sources = false;
+	bool sync = false;
+	bool archive = false;
+	bool archive_sources = false;
+	bool prune_sources = false;
+
+	// all installed versions are needed, i.e. for metrics
+	bool full_inventory = false;
+
+	// space to be freed is counted for metrics
+	bool measure_reclaimable = false;
+
+	std::set<version_info> selected_kernels;
+};
 
-int main(int argc, char **argv)
+// Resolves absolute path inside of root the same way it would be resolved after chroot into it:
+// absolute symlinks point into root and ".." never leaves it. Result is path on host without symlinks,
+// so directories of system image can't point into host system. Missing part of path is appended as is
+std::string resolve_in_root(const std::string &root, const std::string &path)
 {
-	try
-	{
-		bool list_only = false;
-		bool verbose = false;
-		bool dry_run = false;
-		bool help = false;
-		bool do_not_touch_vmlinuzold = false;
-		bool clean_old = false;
-		bool keep_sources = false;
+	std::list<std::string> pending;
+	std::vector<std::string> resolved;
+	unsigned int links = 0;
+	bool missing = false;
 
-		std::set<version_info> selected_kernels;
+	auto split_path = [](const std::string &value)
+	{
+		std::list<std::string> result;
+		size_t start = 0;
 
-		for (int i = 1; i < argc; ++i)
+		while (start <= value.length())
 		{
-			if ((strcmp(argv[i],"--help") == 0) || (strcmp(argv[i], "-h") == 0))
-			{
-				help = true;
-			}
-			else if ((strcmp(argv[i],"--list-only") == 0) || (strcmp(argv[i], "-l") == 0))
-			{
-				list_only = true;
-			}
-			else if ((strcmp(argv[i],"--verbose") == 0) || (strcmp(argv[i], "-v") == 0))
-			{
-				verbose = true;
-			}
-			else if ((strcmp(argv[i],"--dryrun") == 0) || (strcmp(argv[i], "-n") == 0))
-			{
-				dry_run = true;
-			}
-			else if ((strcmp(argv[i],"--keep-vmlinuzold") == 0) || (strcmp(argv[i], "-k") == 0))
-			{
-				do_not_touch_vmlinuzold = true;
-			}
-			else if ((strcmp(argv[i],"--clean-old") == 0) || (strcmp(argv[i], "-c") == 0))
-			{
-				clean_old = true;
-			}
-			else if ((strcmp(argv[i],"--keep-sources") == 0) || (strcmp(argv[i], "-s") == 0))
+			size_t end = value.find('/', start);
+			if (end == std::string::npos)
 			{
-				keep_sources = true;
+				end = value.length();
 			}
-			else
-			{
-				std::cmatch reg_results;
-
-				if (std::regex_match(argv[i], reg_results, std::regex(regex_input_capture)))
-				{
-					version_info version(convertStringToVersion(reg_results.str(1)), reg_results.str(2));
 
-					if (selected_kernels.find(version) == selected_kernels.end())
-					{
-						selected_kernels.insert(version);
-					}
-					else
-					{
-						fprintf(stderr, "Kernel version is specified multiple times: %s\n", version.toString().c_str());
-						return 0;
-					}
-				}
-				else
-				{
-					fprintf(stderr, "Unknown option or invalid format of kernel version: %s, try %s --help for more information\n", argv[i], argv[0]);
-					return 0;
-				}
-			}
+			result.push_back(value.substr(start, end - start));
+			start = end + 1;
 		}
 
-		if (help)
-		{
-			print_help(argv[0]);
-			return 0;
-		}
+		return result;
+	};
 
-		if ((!list_only) && selected_kernels.empty() && (!clean_old))
-		{
-			fprintf(stderr, "Error: no kernel versions or other actions are specified. Try %s --help for more information\n", argv[0]);
-			return -1;
-		}
+	auto join_path = [&root](const std::vector<std::string> &components)
+	{
+		std::string result = root;
 
-		if (list_only && (!selected_kernels.empty()) && clean_old)
+		for (auto iter = components.begin(); iter != components.end(); ++iter)
 		{
-			fprintf(stderr, "Error: too much incompatible action options are specified. Try %s --help for more information\n", argv[0]);
-			return -1;
+			result += "/" + *iter;
 		}
 
-		// First, get all kernel source versions from /usr/src. There's no way to differ between revision and local version without checking against available kernel source versions
-		if (verbose)
+		return result;
+	};
+
+	pending = split_path(path);
+
+	while (!pending.empty())
+	{
+		const std::string component = pending.front();
+		pending.pop_front();
+
+		if (component.empty() || (component == "."))
 		{
-			printf("Directories in %s:\n", directory_src.c_str());
+			continue;
 		}
 
-		std::set<std::string> files = list_files_in_directory(directory_src, { regex_files_src_check });
-
-		for (auto iter = files.begin(); iter != files.end(); ++iter)
+		if (component == "..")
 		{
-			if (verbose)
+			if (!resolved.empty())
 			{
-				printf("%s\n", iter->c_str());
+				resolved.pop_back();
 			}
 
-			std::smatch reg_results;
+			continue;
+		}
 
-			if (std::regex_match(*iter, reg_results, std::regex(regex_files_src_capture)))
-			{
-				std::vector<version_info_type> version_vector = convertStringToVersion(reg_results.str(1));
-				std::string revision_string = reg_results.str(2);
+		resolved.push_back(component);
 
-				kernel_src_versions[version_vector].insert(revision_string);
-			}
+		if (missing)
+		{
+			continue;
 		}
 
-		// Now check /boot
-		if (verbose)
+		struct stat buffer;
+
+		if (lstat(join_path(resolved).c_str(), &buffer) == -1)
 		{
-			printf("\nFiles in %s:\n", directory_boot.c_str());
+			missing = true;
+			continue;
 		}
 
-		files = list_files_in_directory(directory_boot, { regex_files_boot_check, regex_files_boot_initramfs_check });
-
-		for (auto iter = files.begin(); iter != files.end(); ++iter)
+		if (S_ISLNK(buffer.st_mode))
 		{
-			if (verbose)
+			if (++links > 40)
 			{
-				printf("%s\n", iter->c_str());
+				throw std::runtime_error("Too many levels of symbolic links in root " + root + ": " + path);
 			}
 
-			std::smatch reg_results;
+			std::vector<char> target(PATH_MAX + 1, '\0');
+			ssize_t length = readlink(join_path(resolved).c_str(), target.data(), PATH_MAX);
 
-			if (std::regex_match(*iter, reg_results, std::regex(regex_files_boot_capture_old))
-				|| std::regex_match(*iter, reg_results, std::regex(regex_files_boot_capture))
-				|| std::regex_match(*iter, reg_results, std::regex(regex_files_boot_initramfs_capture)))
+			if (length <= 0)
 			{
-				std::vector<version_info_type> version_vector = convertStringToVersion(reg_results.str(1));
-				std::string revision_and_local_version_string = reg_results.str(2);
-
-				auto kernel_src_version = kernel_src_versions.find(version_vector);
-				if (kernel_src_version != kernel_src_versions.end())
-				{
-					auto kernel_src_revision = kernel_src_version->second.begin();
-					auto kernel_src_revision_end = kernel_src_version->second.end();
+				throw std::runtime_error("Failed to read symbolic link: " + join_path(resolved));
+			}
 
-					for ( ; kernel_src_revision != kernel_src_revision_end; ++kernel_src_revision)
-					{
-						if (kernel_src_revision->compare(0, std::string::npos, revision_and_local_version_string, 0, kernel_src_revision->length()) == 0)
-						{
-							break;
-						}
-					}
+			resolved.pop_back();
 
-					if (kernel_src_revision != kernel_src_revision_end)
-					{
-						kernel_versions_tree[version_vector][*kernel_src_revision].insert(revision_and_local_version_string.substr(kernel_src_revision->length()));
-					}
-					else
-					{
-						kernel_versions_tree[version_vector][revision_and_local_version_string].insert(std::string());
-					}
-				}
-				else
-				{
-					kernel_versions_tree[version_vector][revision_and_local_version_string].insert(std::string());
-				}
+			if (target[0] == '/')
+			{
+				resolved.clear();
 			}
-		}
 
-		// Now check /lib/modules
-		if (verbose)
-		{
-			printf("\nDirectories in %s:\n", directory_modules.c_str());
+			pending.splice(pending.begin(), split_path(std::string(target.data(), length)));
 		}
+	}
 
-		files = list_files_in_directory(directory_modules, { regex_files_modules_check });
+	return join_path(resolved);
+}
 
-		for (auto iter = files.begin(); iter != files.end(); ++iter)
+// Everything found in single system root, i.e. in host system or in mounted image
+struct root_context
+{
+	explicit root_context(const std::string &l_root, const std::optional<version_info> &l_running_kernel)
+		: root(l_root),
+		running_kernel(l_running_kernel)
+	{
+		// Root which can't be resolved, i.e. due to symlink loop, is kept with error and without directories.
+		// Error is reported when root is scanned, so that other roots are still processed
+		try
 		{
-			if (verbose)
-			{
-				printf("%s\n", iter->c_str());
-			}
+			directory_boot = (l_root.empty() ? ::directory_boot : resolve_in_root(l_root, ::directory_boot));
+			directory_modules = (l_root.empty() ? ::directory_modules : resolve_in_root(l_root, ::directory_modules));
+			directory_src = (l_root.empty() ? ::directory_src : resolve_in_root(l_root, ::directory_src));
+		}
+		catch (...)
+		{
+			directory_boot.clear();
+			directory_modules.clear();
+			directory_src.clear();
+			error = std::current_exception();
+		}
+	}
 
-			std::smatch reg_results;
+	std::string name() const
+	{
+		return (root.empty() ? std::string("/") : root);
+	}
 
-			if (std::regex_match(*iter, reg_results, std::regex(regex_files_modules_capture)))
-			{
-				std::vector<version_info_type> version_vector = convertStringToVersion(reg_results.str(1));
-				std::string revision_and_local_version_string = reg_results.str(2);
+	// prefix for all paths, empty for host system
+	std::string root;
 
-				auto kernel_src_version = kernel_src_versions.find(version_vector);
-				if (kernel_src_version != kernel_src_versions.end())
-				{
-					auto kernel_src_revision = kernel_src_version->second.begin();
-					auto kernel_src_revision_end = kernel_src_version->second.end();
+	// resolved inside of root
+	std::string directory_boot;
+	std::string directory_modules;
+	std::string directory_src;
 
-					for ( ; kernel_src_revision != kernel_src_revision_end; ++kernel_src_revision)
-					{
-						if (kernel_src_revision->compare(0, std::string::npos, revision_and_local_version_string, 0, kernel_src_revision->length()) == 0)
-						{
-							break;
-						}
-					}
+	// if not set, version returned by uname() is used for host system
+	std::optional<version_info> running_kernel;
 
-					if (kernel_src_revision != kernel_src_revision_end)
-					{
-						kernel_versions_tree[version_vector][*kernel_src_revision].insert(revision_and_local_version_string.substr(kernel_src_revision->length()));
-					}
-					else
-					{
-						kernel_versions_tree[version_vector][revision_and_local_version_string].insert(std::string());
-					}
-				}
-				else
-				{
-					kernel_versions_tree[version_vector][revision_and_local_version_string].insert(std::string());
-				}
-			}
-		}
+	kernel_src_versions_map kernel_src_versions;
+	kernel_versions_tree_map kernel_versions_tree;
 
-		if (verbose)
-		{
-			printf("\n");
-		}
+	// kernel files found in /boot, if it was scanned
+	std::set<std::string> boot_files;
+	bool boot_scanned = false;
 
-		if (list_only)
-		{
-			printf("kernel source tree for versions:\n");
+	// versions left after removal, only collected for full inventory
+	std::set<std::string> kernels;
+	std::set<std::string> kernel_sources;
 
-			for (auto iter_version = kernel_src_versions.begin(); iter_version != kernel_src_versions.end(); ++iter_version)
-			{
-				for (auto iter_revision = iter_version->second.begin(); iter_revision != iter_version->second.end(); ++iter_revision)
-				{
-					printf("%s\n", version_info(iter_version->first, *iter_revision).toString().c_str());
-				}
-			}
+	// versions selected for removal, see update_installed_versions()
+	std::set<std::string> kernels_queued;
+	std::set<std::string> kernel_sources_queued;
 
-			printf("\nkernel image and module versions:\n");
+	size_t kernels_removed = 0;
+	size_t kernel_sources_removed = 0;
 
-			for (auto iter_version = kernel_versions_tree.begin(); iter_version != kernel_versions_tree.end(); ++iter_version)
-			{
-				for (auto iter_revision = iter_version->second.begin(); iter_revision != iter_version->second.end(); ++iter_revision)
-				{
-					for (auto iter_local_version = iter_revision->second.begin(); iter_local_version != iter_revision->second.end(); ++iter_local_version)
-					{
-						printf("%s\n", version_info(iter_version->first, iter_revision->first, *iter_local_version).toString().c_str());
-					}
-				}
-			}
-		}
-		else
-		{
-			if (clean_old)
-			{
-				struct utsname name;
+	// space occupied by files queued for removal
+	uint64_t reclaimable_bytes = 0;
 
-				if (uname(&name) == -1)
-				{
-					throw std::runtime_error("uname() call failed");
-				}
+	size_t statistics_group = 0;
 
-				std::string current_version = name.release;
+	// messages are collected in memory when multiple roots are processed in parallel
+	FILE *output = stdout;
+	char *output_buffer = NULL;
+	size_t output_size = 0;
 
-				std::smatch reg_results;
+	std::exception_ptr error;
+};
 
-				if (!std::regex_match(current_version, reg_results, std::regex(regex_input_capture)))
-				{
-					std::stringstream str;
-					str << "Failed to parse version string returned by uname(): " << current_version;
-					throw std::runtime_error(str.str());
-				}
+std::optional<version_info> parse_kernel_version(const std::string &version_string)
+{
+	std::smatch reg_results;
 
-				version_info version(convertStringToVersion(reg_results.str(1)), reg_results.str(2));
+	if (!std::regex_match(version_string, reg_results, std::regex(regex_input_capture)))
+	{
+		return std::optional<version_info>();
+	}
 
-				selected_kernels.clear();
+	return version_info(convertStringToVersion(reg_results.str(1)), reg_results.str(2));
+}
 
-				auto kernel_version = kernel_versions_tree.begin();
-				auto kernel_version_end = kernel_versions_tree.end();
+version_info get_running_kernel_version()
+{
+	struct utsname name;
 
-				for ( ; kernel_version != kernel_version_end; ++kernel_version)
-				{
-					auto kernel_revision = kernel_version->second.begin();
-					auto kernel_revision_end = kernel_version->second.end();
+	if (uname(&name) == -1)
+	{
+		throw std::runtime_error("uname() call failed");
+	}
 
-					for ( ; kernel_revision != kernel_revision_end; ++kernel_revision)
-					{
-						auto kernel_local_version = kernel_revision->second.begin();
-						auto kernel_local_version_end = kernel_revision->second.end();
+	std::optional<version_info> version = parse_kernel_version(name.release);
 
-						for ( ; kernel_local_version != kernel_local_version_end; ++kernel_local_version)
-						{
-							version_info found_version(kernel_version->first, kernel_revision->first, *kernel_local_version);
+	if (!version)
+	{
+		std::stringstream str;
+		str << "Failed to parse version string returned by uname(): " << name.release;
+		throw std::runtime_error(str.str());
+	}
 
-							if (version.toString() != found_version.toString())
-							{
-								selected_kernels.insert(found_version);
+	return *version;
+}
+
+// Host system is represented by empty root
+std::string normalize_root(const std::string &root)
+{
+	std::string result = root;
+
+	while ((!result.empty()) && (result.back() == '/'))
+	{
+		result.pop_back();
+	}
+
+	return result;
+}
+
+// Each line contains root directory and optionally running kernel version separated by whitespace. Empty lines and lines starting with '#' are skipped
+void read_roots_file(const std::string &filename, std::list<std::pair<std::string, std::optional<version_info> > > &roots)
+{
+	std::ifstream file(filename);
+	if (!file)
+	{
+		throw std::runtime_error("Failed to open file: " + filename);
+	}
+
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		std::istringstream line_stream(line);
+		std::string root;
+		std::string version_string;
+		std::string extra;
+
+		if ((!(line_stream >> root)) || (root[0] == '#'))
+		{
+			continue;
+		}
+
+		std::optional<version_info> version;
+
+		if (line_stream >> version_string)
+		{
+			version = parse_kernel_version(version_string);
+
+			if ((!version) || (line_stream >> extra))
+			{
+				throw std::runtime_error("Invalid line in file " + filename + ": " + line);
+			}
+		}
+
+		roots.push_back(std::make_pair(normalize_root(root), version));
+	}
+}
+
+// Missing components are reported as 0, i.e. for probes
+version_info_type version_component(const std::vector<version_info_type> &version, size_t index)
+{
+	return ((index < version.size()) ? version[index] : 0);
+}
+
+// Splits revision and local version using found kernel sources. If no matching sources are found, everything is considered revision
+void add_kernel_version(root_context &context, const std::vector<version_info_type> &version_vector, const std::string &revision_and_local_version_string)
+{
+	size_t revision_length = revision_and_local_version_string.length();
+
+	auto kernel_src_version = context.kernel_src_versions.find(version_vector);
+	if (kernel_src_version != context.kernel_src_versions.end())
+	{
+		auto kernel_src_revision = kernel_src_version->second.begin();
+		auto kernel_src_revision_end = kernel_src_version->second.end();
+
+		for ( ; kernel_src_revision != kernel_src_revision_end; ++kernel_src_revision)
+		{
+			if (kernel_src_revision->compare(0, std::string::npos, revision_and_local_version_string, 0, kernel_src_revision->length()) == 0)
+			{
+				break;
+			}
+		}
+
+		if (kernel_src_revision != kernel_src_revision_end)
+		{
+			revision_length = kernel_src_revision->length();
+		}
+	}
+
+	auto revision = context.kernel_versions_tree[version_vector].emplace(revision_and_local_version_string.substr(0, revision_length), std::set<std::string>()).first;
+	revision->second.insert(revision_and_local_version_string.substr(revision_length));
+
+	DT_KERNEL_CLEANER_PROBE6(version_resolved, context.root.c_str(),
+		version_component(version_vector, 0), version_component(version_vector, 1), version_component(version_vector, 2),
+		revision->first.c_str(), revision_and_local_version_string.c_str() + revision_length);
+}
+
+// Builds list of name prefixes which may belong to any of specified kernel versions, i.e. "<prefix><version>-" and "<prefix><version>_"
+std::set<std::string> build_name_prefixes(const std::set<version_info> &kernels, const std::list<std::string> &prefixes)
+{
+	std::set<std::string> result;
+
+	for (auto kernel_iter = kernels.begin(); kernel_iter != kernels.end(); ++kernel_iter)
+	{
+		std::string version_str = versionToString(kernel_iter->version);
+
+		for (auto prefix_iter = prefixes.begin(); prefix_iter != prefixes.end(); ++prefix_iter)
+		{
+			result.insert(*prefix_iter + version_str + "-");
+			result.insert(*prefix_iter + version_str + "_");
+		}
+	}
+
+	return result;
+}
+
+// Checks if any file in /boot or /lib/modules named after specified kernel version exists
+bool kernel_files_left(const root_context &context, const std::string &version_str, bool verbose)
+{
+	const std::list<std::string> candidates = {
+		context.directory_modules + "/" + version_str,
+		context.directory_boot + "/" + version_str,
+		context.directory_boot + "/" + version_str + ".old",
+		context.directory_boot + "/" + prefix_boot_config + version_str,
+		context.directory_boot + "/" + prefix_boot_config + version_str + ".old",
+		context.directory_boot + "/" + prefix_boot_map + version_str,
+		context.directory_boot + "/" + prefix_boot_map + version_str + ".old",
+		context.directory_boot + "/" + prefix_boot_image + version_str,
+		context.directory_boot + "/" + prefix_boot_image + version_str + ".old",
+		context.directory_boot + "/" + prefix_boot_initramfs + version_str + ".img",
+		context.directory_boot + "/" + prefix_boot_initramfs + version_str + ".img.old"
+	};
+
+	for (auto iter = candidates.begin(); iter != candidates.end(); ++iter)
+	{
+		struct stat buffer;
+
+		if (lstat(iter->c_str(), &buffer) != -1)
+		{
+			if (verbose)
+			{
+				fprintf(context.output, "%s\n", iter->c_str());
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Checks if any file in /boot or /lib/modules exists which would be recognized exactly as specified kernel version during directory scan
+bool kernel_files_exist(const root_context &context, const version_info &kernel, bool verbose)
+{
+	// Empty revision is never recognized, and dots in revision may be confused with ".old" and ".img" suffixes
+	if (kernel.revision.empty() || (kernel.revision.find('.') != std::string::npos))
+	{
+		return false;
+	}
+
+	return kernel_files_left(context, kernel.toString(), verbose);
+}
+
+// Versions queued for removal are only gone when removal of their files succeeded
+void update_installed_versions(root_context &context)
+{
+	for (auto iter = context.kernels_queued.begin(); iter != context.kernels_queued.end(); ++iter)
+	{
+		if (!kernel_files_left(context, *iter, false))
+		{
+			context.kernels.erase(*iter);
+		}
+	}
+
+	for (auto iter = context.kernel_sources_queued.begin(); iter != context.kernel_sources_queued.end(); ++iter)
+	{
+		struct stat buffer;
+
+		if ((lstat((context.directory_src + "/" + prefix_src + *iter).c_str(), &buffer) == -1) && (errno == ENOENT))
+		{
+			context.kernel_sources.erase(*iter);
+		}
+	}
+}
+
+// Files in /boot are looked up in memory if it was scanned, instead of looking into huge directory again for every kernel
+bool boot_file_exists(const root_context &context, const std::string &name)
+{
+	if (context.boot_scanned)
+	{
+		return (context.boot_files.find(name) != context.boot_files.end());
+	}
+
+	struct stat buffer;
+
+	return (lstat((context.directory_boot + "/" + name).c_str(), &buffer) != -1);
+}
+
+// Space occupied by files of directory tree, counted the same way as during removal
+uint64_t tree_disk_usage(const std::string &directory)
+{
+	std::map<std::string, uint64_t> files;
+	std::set<std::string> directories;
+	uint64_t result = 0;
+
+	find_all_files_and_dirs(directory, files, directories);
+
+	for (auto iter = files.begin(); iter != files.end(); ++iter)
+	{
+		result += iter->second;
+	}
+
+	return result;
+}
+
+// Space occupied by build output in kernel sources, found the same way as during pruning
+uint64_t build_artifacts_disk_usage(const std::string &directory)
+{
+	std::map<std::string, uint64_t> files;
+	std::set<std::string> artifact_directories;
+	std::set<std::string> subdirectories;
+	uint64_t result = 0;
+
+	find_build_artifacts(directory, files, artifact_directories, subdirectories);
+
+	for (auto iter = files.begin(); iter != files.end(); ++iter)
+	{
+		result += iter->second;
+	}
+
+	for (auto iter = artifact_directories.begin(); iter != artifact_directories.end(); ++iter)
+	{
+		result += tree_disk_usage(*iter);
+	}
+
+	for (auto iter = subdirectories.begin(); iter != subdirectories.end(); ++iter)
+	{
+		result += build_artifacts_disk_usage(*iter);
+	}
+
+	return result;
+}
+
+// Space to be freed is counted when removal is queued, so that it's known for dry run too
+void queue_file_removal(root_context &context, const cleaner_options &options, removal_scheduler &scheduler, const std::string &file, bool archive)
+{
+	if (options.verbose)
+	{
+		fprintf(context.output, "Removing file %s\n", file.c_str());
+	}
+
+	if (options.measure_reclaimable)
+	{
+		struct stat buffer;
+
+		if (lstat(file.c_str(), &buffer) != -1)
+		{
+			context.reclaimable_bytes += static_cast<uint64_t>(buffer.st_blocks) * 512;
+		}
+	}
+
+	if (!options.dry_run)
+	{
+		scheduler.add_file(file, context.statistics_group, archive);
+	}
+}
+
+void queue_tree_removal(root_context &context, const cleaner_options &options, removal_scheduler &scheduler, const std::string &directory, bool archive)
+{
+	if (options.verbose)
+	{
+		fprintf(context.output, "Recursively removing directory %s\n", directory.c_str());
+	}
+
+	if (options.measure_reclaimable)
+	{
+		context.reclaimable_bytes += tree_disk_usage(directory);
+	}
+
+	if (!options.dry_run)
+	{
+		scheduler.add_tree(directory, context.statistics_group, archive);
+	}
+}
+
+// Queues removal of all files of single kernel
+void queue_kernel_removal(root_context &context, const cleaner_options &options, removal_scheduler &scheduler, const std::string &version_str)
+{
+	fprintf(context.output, "Removing kernel version %s\n", version_str.c_str());
+	++(context.kernels_removed);
+
+	// clean everything in /boot
+	queue_file_removal(context, options, scheduler, context.directory_boot + "/" + prefix_boot_config + version_str, options.archive);
+	queue_file_removal(context, options, scheduler, context.directory_boot + "/" + prefix_boot_map + version_str, options.archive);
+	queue_file_removal(context, options, scheduler, context.directory_boot + "/" + prefix_boot_image + version_str, options.archive);
+
+	const std::string optional_files[] = {
+		prefix_boot_initramfs + version_str + ".img",
+		prefix_boot_config + version_str + ".old",
+		prefix_boot_map + version_str + ".old",
+		prefix_boot_image + version_str + ".old",
+		prefix_boot_initramfs + version_str + ".img.old"
+	};
+
+	for (size_t i = 0; i < sizeof(optional_files) / sizeof(optional_files[0]); ++i)
+	{
+		if (boot_file_exists(context, optional_files[i]))
+		{
+			queue_file_removal(context, options, scheduler, context.directory_boot + "/" + optional_files[i], options.archive);
+		}
+	}
+
+	// clean everything in /lib/modules
+	context.kernels_queued.insert(version_str);
+
+	queue_tree_removal(context, options, scheduler, context.directory_modules + "/" + version_str, options.archive);
+}
+
+// Queues removal of sources of single kernel
+void queue_kernel_sources_removal(root_context &context, const cleaner_options &options, removal_scheduler &scheduler, const std::string &version_str)
+{
+	fprintf(context.output, "Removing kernel sources version %s\n", version_str.c_str());
+	++(context.kernel_sources_removed);
+
+	// clean everything in /usr/src
+	context.kernel_sources_queued.insert(version_str);
+
+	queue_tree_removal(context, options, scheduler, context.directory_src + "/" + prefix_src + version_str, options.archive && options.archive_sources);
+}
+
+// Finds kernels in root, prints them if only listing is requested, otherwise queues removal of selected kernels
+void scan_root(root_context &context, const cleaner_options &options, removal_scheduler &scheduler)
+{
+	// directories of root couldn't be resolved
+	if (context.error)
+	{
+		std::rethrow_exception(context.error);
+	}
+
+	// When only explicitly specified kernel versions are going to be removed, there's no need to look at any other versions.
+	// Try to resolve them without directory scan first. If it's not possible, scan directories but only check entries with matching versions.
+	// Metrics need to list all installed versions, so everything is scanned in that case
+	std::set<version_info> selected_kernels = options.selected_kernels;
+
+	const bool targeted_lookup = (!options.list_only) && (!options.clean_old) && (!selected_kernels.empty()) && (!options.full_inventory);
+	bool scan_src = true;
+	bool scan_kernels = true;
+
+	std::set<std::string> src_name_prefixes;
+	std::set<std::string> boot_name_prefixes;
+	std::set<std::string> modules_name_prefixes;
+
+	// Compiling regex takes much longer than matching it, so each one is compiled once and not for every found file
+	const std::regex files_src_capture(regex_files_src_capture);
+	const std::regex files_boot_capture(regex_files_boot_capture);
+	const std::regex files_boot_capture_old(regex_files_boot_capture_old);
+	const std::regex files_boot_initramfs_capture(regex_files_boot_initramfs_capture);
+	const std::regex files_modules_capture(regex_files_modules_capture);
+
+	if (targeted_lookup)
+	{
+		src_name_prefixes = build_name_prefixes(selected_kernels, { std::string(), prefix_src });
+		boot_name_prefixes = build_name_prefixes(selected_kernels, { std::string(), prefix_boot_config, prefix_boot_map, prefix_boot_image, prefix_boot_initramfs });
+		modules_name_prefixes = build_name_prefixes(selected_kernels, { std::string() });
+
+		if (options.verbose)
+		{
+			fprintf(context.output, "Kernel files found without directory scan:\n");
+		}
+
+		bool all_kernels_exist = true;
+
+		for (auto iter = selected_kernels.begin(); iter != selected_kernels.end(); ++iter)
+		{
+			if (!kernel_files_exist(context, *iter, options.verbose))
+			{
+				all_kernels_exist = false;
+			}
+		}
+
+		if (options.verbose)
+		{
+			fprintf(context.output, "\n");
+		}
+
+		// Sources are only needed to find kernels built from them, or to decide if they should be removed
+		scan_src = (!all_kernels_exist) || (!options.keep_sources);
+		scan_kernels = (!all_kernels_exist);
+	}
+
+	// First, get all kernel source versions from /usr/src. There's no way to differ between revision and local version without checking against available kernel source versions
+	if (scan_src)
+	{
+		if (options.verbose)
+		{
+			fprintf(context.output, "Directories in %s:\n", context.directory_src.c_str());
+		}
+
+		std::set<std::string> files = list_files_in_directory(context.directory_src, { regex_files_src_check }, src_name_prefixes);
+
+		for (auto iter = files.begin(); iter != files.end(); ++iter)
+		{
+			if (options.verbose)
+			{
+				fprintf(context.output, "%s\n", iter->c_str());
+			}
+
+			std::smatch reg_results;
+
+			if (std::regex_match(*iter, reg_results, files_src_capture))
+			{
+				DT_KERNEL_CLEANER_PROBE3(entry_classified, context.directory_src.c_str(), iter->c_str(), "source");
+
+				std::vector<version_info_type> version_vector = convertStringToVersion(reg_results.str(1));
+				std::string revision_string = reg_results.str(2);
+
+				context.kernel_src_versions[version_vector].insert(revision_string);
+			}
+		}
+
+		if (options.verbose)
+		{
+			fprintf(context.output, "\n");
+		}
+	}
+
+	// If kernel may be built from found sources, it's needed to know all other kernels built from same sources
+	if (targeted_lookup && (!scan_kernels) && (!options.keep_sources))
+	{
+		for (auto iter = selected_kernels.begin(); (iter != selected_kernels.end()) && (!scan_kernels); ++iter)
+		{
+			auto kernel_src_version = context.kernel_src_versions.find(iter->version);
+			if (kernel_src_version != context.kernel_src_versions.end())
+			{
+				for (auto kernel_src_revision = kernel_src_version->second.begin(); kernel_src_revision != kernel_src_version->second.end(); ++kernel_src_revision)
+				{
+					if (kernel_src_revision->compare(0, std::string::npos, iter->revision, 0, kernel_src_revision->length()) == 0)
+					{
+						scan_kernels = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	if (scan_kernels)
+	{
+		// Now check /boot
+		if (options.verbose)
+		{
+			fprintf(context.output, "Files in %s:\n", context.directory_boot.c_str());
+		}
+
+		context.boot_files = list_files_in_directory(context.directory_boot, { regex_files_boot_check, regex_files_boot_initramfs_check }, boot_name_prefixes);
+		context.boot_scanned = true;
+
+		for (auto iter = context.boot_files.begin(); iter != context.boot_files.end(); ++iter)
+		{
+			if (options.verbose)
+			{
+				fprintf(context.output, "%s\n", iter->c_str());
+			}
+
+			std::smatch reg_results;
+
+			if (std::regex_match(*iter, reg_results, files_boot_capture_old)
+				|| std::regex_match(*iter, reg_results, files_boot_capture)
+				|| std::regex_match(*iter, reg_results, files_boot_initramfs_capture))
+			{
+				DT_KERNEL_CLEANER_PROBE3(entry_classified, context.directory_boot.c_str(), iter->c_str(), "boot");
+
+				add_kernel_version(context, convertStringToVersion(reg_results.str(1)), reg_results.str(2));
+			}
+		}
+
+		// Now check /lib/modules
+		if (options.verbose)
+		{
+			fprintf(context.output, "\nDirectories in %s:\n", context.directory_modules.c_str());
+		}
+
+		std::set<std::string> files = list_files_in_directory(context.directory_modules, { regex_files_modules_check }, modules_name_prefixes);
+
+		for (auto iter = files.begin(); iter != files.end(); ++iter)
+		{
+			if (options.verbose)
+			{
+				fprintf(context.output, "%s\n", iter->c_str());
+			}
+
+			std::smatch reg_results;
+
+			if (std::regex_match(*iter, reg_results, files_modules_capture))
+			{
+				DT_KERNEL_CLEANER_PROBE3(entry_classified, context.directory_modules.c_str(), iter->c_str(), "modules");
+
+				add_kernel_version(context, convertStringToVersion(reg_results.str(1)), reg_results.str(2));
+			}
+		}
+
+		if (options.verbose)
+		{
+			fprintf(context.output, "\n");
+		}
+	}
+	else
+	{
+		// All selected kernels are found and there's no ambiguity in splitting revision and local version
+		for (auto iter = selected_kernels.begin(); iter != selected_kernels.end(); ++iter)
+		{
+			context.kernel_versions_tree[iter->version][iter->revision].insert(iter->local_version);
+
+			DT_KERNEL_CLEANER_PROBE6(version_resolved, context.root.c_str(),
+				version_component(iter->version, 0), version_component(iter->version, 1), version_component(iter->version, 2),
+				iter->revision.c_str(), iter->local_version.c_str());
+		}
+	}
+
+	if (options.full_inventory)
+	{
+		for (auto iter_version = context.kernel_src_versions.begin(); iter_version != context.kernel_src_versions.end(); ++iter_version)
+		{
+			for (auto iter_revision = iter_version->second.begin(); iter_revision != iter_version->second.end(); ++iter_revision)
+			{
+				context.kernel_sources.insert(version_info(iter_version->first, *iter_revision).toString());
+			}
+		}
+
+		for (auto iter_version = context.kernel_versions_tree.begin(); iter_version != context.kernel_versions_tree.end(); ++iter_version)
+		{
+			for (auto iter_revision = iter_version->second.begin(); iter_revision != iter_version->second.end(); ++iter_revision)
+			{
+				for (auto iter_local_version = iter_revision->second.begin(); iter_local_version != iter_revision->second.end(); ++iter_local_version)
+				{
+					context.kernels.insert(version_info(iter_version->first, iter_revision->first, *iter_local_version).toString());
+				}
+			}
+		}
+	}
+
+	if (options.list_only)
+	{
+		fprintf(context.output, "kernel source tree for versions:\n");
+
+		for (auto iter_version = context.kernel_src_versions.begin(); iter_version != context.kernel_src_versions.end(); ++iter_version)
+		{
+			for (auto iter_revision = iter_version->second.begin(); iter_revision != iter_version->second.end(); ++iter_revision)
+			{
+				fprintf(context.output, "%s\n", version_info(iter_version->first, *iter_revision).toString().c_str());
+			}
+		}
+
+		fprintf(context.output, "\nkernel image and module versions:\n");
+
+		for (auto iter_version = context.kernel_versions_tree.begin(); iter_version != context.kernel_versions_tree.end(); ++iter_version)
+		{
+			for (auto iter_revision = iter_version->second.begin(); iter_revision != iter_version->second.end(); ++iter_revision)
+			{
+				for (auto iter_local_version = iter_revision->second.begin(); iter_local_version != iter_revision->second.end(); ++iter_local_version)
+				{
+					fprintf(context.output, "%s\n", version_info(iter_version->first, iter_revision->first, *iter_local_version).toString().c_str());
+				}
+			}
+		}
+	}
+	else
+	{
+		std::set<std::string> removed_sources;
+
+		if (options.clean_old)
+		{
+			if ((!context.running_kernel) && (!context.root.empty()))
+			{
+				throw std::runtime_error("Running kernel version is not specified for root " + context.root);
+			}
+
+			version_info version = context.running_kernel ? *(context.running_kernel) : get_running_kernel_version();
+
+			// Every kernel except running one is removed, so removals are queued in a single pass over the tree
+			// instead of selecting kernels first and then looking each of them up again.
+			// Running kernel is matched by parts, so version strings are built only for kernels actually being removed
+			std::string running_revision_and_local_version = version.revision + version.local_version;
+
+			selected_kernels.clear();
+
+			auto kernel_version = context.kernel_versions_tree.begin();
+			auto kernel_version_end = context.kernel_versions_tree.end();
+
+			for ( ; kernel_version != kernel_version_end; ++kernel_version)
+			{
+				const bool running_version = (kernel_version->first == version.version);
+				std::string version_string;
+
+				auto kernel_revision = kernel_version->second.begin();
+				auto kernel_revision_end = kernel_version->second.end();
+
+				for ( ; kernel_revision != kernel_revision_end; ++kernel_revision)
+				{
+					const bool running_revision = running_version
+						&& (running_revision_and_local_version.compare(0, kernel_revision->first.length(), kernel_revision->first) == 0);
+					std::string revision_string;
+
+					auto kernel_local_version = kernel_revision->second.begin();
+
+					while (kernel_local_version != kernel_revision->second.end())
+					{
+						if (running_revision
+							&& (running_revision_and_local_version.compare(kernel_revision->first.length(), std::string::npos, *kernel_local_version) == 0))
+						{
+							++kernel_local_version;
+							continue;
+						}
+
+						if (version_string.empty())
+						{
+							version_string = versionToString(kernel_version->first);
+						}
+
+						if (revision_string.empty())
+						{
+							revision_string = version_string + kernel_revision->first;
+						}
+
+						queue_kernel_removal(context, options, scheduler, revision_string + *kernel_local_version);
+
+						// remove kernel from lists
+						kernel_local_version = kernel_revision->second.erase(kernel_local_version);
+					}
+
+					if ((!options.keep_sources)
+						&& (!revision_string.empty())
+						&& kernel_revision->second.empty()
+						&& (context.kernel_src_versions.find(kernel_version->first) != context.kernel_src_versions.end()))
+					{
+						queue_kernel_sources_removal(context, options, scheduler, revision_string);
+						removed_sources.insert(revision_string);
+					}
+				}
+			}
+		}
+
+		// Removals are only queued here and executed later for all selected kernels and roots at once
+		auto kernel_version_iter = selected_kernels.begin();
+		auto kernel_version_iter_end = selected_kernels.end();
+
+		for (; kernel_version_iter != kernel_version_iter_end; ++kernel_version_iter)
+		{
+			bool found_kernels_matched = false;
+			std::set<version_info> found_kernels;
+			std::optional<version_info> found_kernel_sources;
+
+			{
+				std::vector<version_info_type> version_vector = kernel_version_iter->version;
+				std::string revision_and_local_version_string = kernel_version_iter->revision + kernel_version_iter->local_version;
+
+				auto kernel_version = context.kernel_versions_tree.find(version_vector);
+				if (kernel_version != context.kernel_versions_tree.end())
+				{
+					auto kernel_revision = kernel_version->second.begin();
+					auto kernel_revision_end = kernel_version->second.end();
+
+					for ( ; kernel_revision != kernel_revision_end; ++kernel_revision)
+					{
+						if (kernel_revision->first.compare(0, std::string::npos, revision_and_local_version_string, 0, kernel_revision->first.length()) == 0)
+						{
+							std::string kernel_local_version_string = revision_and_local_version_string.substr(kernel_revision->first.length());
+
+							auto kernel_local_version = kernel_revision->second.find(kernel_local_version_string);
+							if (kernel_local_version != kernel_revision->second.end())
+							{
+								found_kernels.insert(version_info(version_vector, kernel_revision->first, kernel_local_version_string));
+								found_kernels_matched = true;
+								break;
 							}
 						}
 					}
 				}
+
+				auto kernel_src_version = context.kernel_src_versions.find(version_vector);
+				if (kernel_src_version != context.kernel_src_versions.end())
+				{
+					auto kernel_src_revision = kernel_src_version->second.begin();
+					auto kernel_src_revision_end = kernel_src_version->second.end();
+
+					for ( ; kernel_src_revision != kernel_src_revision_end; ++kernel_src_revision)
+					{
+						if (*kernel_src_revision == revision_and_local_version_string)
+						{
+							found_kernel_sources = version_info(version_vector, revision_and_local_version_string);
+							break;
+						}
+					}
+				}
+			}
+
+			// If kernel not found, then kernel sources are removed. Find all kernels built from this source and remove them.
+			// They'll have same version and revision and different local version
+			if (found_kernels.empty() && found_kernel_sources)
+			{
+				std::vector<version_info_type> version_vector = found_kernel_sources->version;
+
+				auto kernel_version = context.kernel_versions_tree.find(version_vector);
+				if (kernel_version != context.kernel_versions_tree.end())
+				{
+					auto kernel_revision = kernel_version->second.find(found_kernel_sources->revision);
+					if (kernel_revision != kernel_version->second.end())
+					{
+						auto kernel_local_version_iter = kernel_revision->second.begin();
+						auto kernel_local_version_end = kernel_revision->second.end();
+
+						for ( ; kernel_local_version_iter != kernel_local_version_end; ++kernel_local_version_iter)
+						{
+							found_kernels.insert(version_info(found_kernel_sources->version, found_kernel_sources->revision, *kernel_local_version_iter));
+						}
+					}
+				}
+			}
+
+			for (auto found_kernel_iter = found_kernels.begin(); found_kernel_iter != found_kernels.end(); ++found_kernel_iter)
+			{
+				queue_kernel_removal(context, options, scheduler, found_kernel_iter->toString());
+
+				// remove kernel from lists
+				context.kernel_versions_tree[found_kernel_iter->version][found_kernel_iter->revision].erase(found_kernel_iter->local_version);
+			}
+
+			if ((!options.keep_sources)
+				&& ((found_kernels_matched
+						&& context.kernel_versions_tree[found_kernels.begin()->version][found_kernels.begin()->revision].empty()
+						&& (context.kernel_src_versions.find(found_kernels.begin()->version) != context.kernel_src_versions.end()))
+					|| ((!found_kernels_matched) && found_kernel_sources)))
+			{
+				std::string version_str;
+
+				if (found_kernels_matched)
+				{
+					version_str = versionToString(found_kernels.begin()->version) + found_kernels.begin()->revision;
+				}
+				else
+				{
+					version_str = found_kernel_sources->toString();
+				}
+
+				queue_kernel_sources_removal(context, options, scheduler, version_str);
+				removed_sources.insert(version_str);
+			}
+		}
+
+		if (options.prune_sources)
+		{
+			for (auto iter_version = context.kernel_src_versions.begin(); iter_version != context.kernel_src_versions.end(); ++iter_version)
+			{
+				for (auto iter_revision = iter_version->second.begin(); iter_revision != iter_version->second.end(); ++iter_revision)
+				{
+					std::string version_str = versionToString(iter_version->first) + *iter_revision;
+
+					if (removed_sources.find(version_str) != removed_sources.end())
+					{
+						continue;
+					}
+
+					fprintf(context.output, "Removing build files from kernel sources version %s\n", version_str.c_str());
+
+					if (options.measure_reclaimable)
+					{
+						context.reclaimable_bytes += build_artifacts_disk_usage(context.directory_src + "/" + prefix_src + version_str);
+					}
+
+					if (!options.dry_run)
+					{
+						scheduler.add_prune(context.directory_src + "/" + prefix_src + version_str, context.statistics_group);
+					}
+				}
+			}
+		}
+	}
+}
+
+// Roots are scanned in parallel, and their messages are printed afterwards one root at a time.
+// Single root is scanned directly, and errors are passed to caller as is
+void scan_roots(std::list<root_context> &contexts, const cleaner_options &options, removal_scheduler &scheduler)
+{
+	if (contexts.size() == 1)
+	{
+		scan_root(contexts.front(), options, scheduler);
+		return;
+	}
+
+	std::vector<root_context*> queue;
+
+	for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
+	{
+		iter->output = open_memstream(&(iter->output_buffer), &(iter->output_size));
+		if (iter->output == NULL)
+		{
+			throw std::runtime_error("open_memstream() call failed");
+		}
+
+		queue.push_back(&(*iter));
+	}
+
+	std::atomic<size_t> next_index(0);
+
+	auto worker = [&queue, &next_index, &options, &scheduler]()
+	{
+		for (;;)
+		{
+			size_t index = next_index++;
+
+			if (index >= queue.size())
+			{
+				break;
+			}
+
+			try
+			{
+				scan_root(*(queue[index]), options, scheduler);
+			}
+			catch (...)
+			{
+				queue[index]->error = std::current_exception();
+			}
+		}
+	};
+
+	size_t threads_count = std::min<size_t>(queue.size(), std::max(4u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < threads_count; ++i)
+	{
+		threads.emplace_back(worker);
+	}
+
+	for (auto iter = threads.begin(); iter != threads.end(); ++iter)
+	{
+		iter->join();
+	}
+
+	for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
+	{
+		fclose(iter->output);
+		iter->output = stdout;
+
+		printf("Root %s:\n", iter->name().c_str());
+		fwrite(iter->output_buffer, 1, iter->output_size, stdout);
+		printf("\n");
+
+		free(iter->output_buffer);
+		iter->output_buffer = NULL;
+
+		if (iter->error)
+		{
+			try
+			{
+				std::rethrow_exception(iter->error);
+			}
+			catch (const std::exception &exc)
+			{
+				fprintf(stderr, "Failed to process root %s: %s\n", iter->name().c_str(), exc.what());
+			}
+			catch (...)
+			{
+				fprintf(stderr, "Failed to process root %s: unknown exception\n", iter->name().c_str());
+			}
+		}
+	}
+}
+
+void print_roots_summary(const std::list<root_context> &contexts, const cleaner_options &options, const removal_scheduler &scheduler)
+{
+	printf("\nSummary:\n");
+
+	for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
+	{
+		if (iter->error)
+		{
+			printf("%s: failed\n", iter->name().c_str());
+		}
+		else if (options.dry_run)
+		{
+			printf("%s: %zu kernels and %zu kernel source trees would be removed\n", iter->name().c_str(), iter->kernels_removed, iter->kernel_sources_removed);
+		}
+		else
+		{
+			removal_statistics statistics = scheduler.statistics(iter->statistics_group);
+
+			printf("%s: %zu kernels and %zu kernel source trees removed, %" PRIu64 " files (%" PRIu64 " bytes) and %" PRIu64 " directories removed, %" PRIu64 " failures\n",
+				iter->name().c_str(), iter->kernels_removed, iter->kernel_sources_removed,
+				statistics.files_removed, statistics.bytes_removed, statistics.directories_removed, statistics.failures);
+		}
+	}
+}
+
+// Path of file symlink in /boot points to. Symlinks of other roots are resolved inside of these roots
+std::string symlink_target_path(const root_context &context, const std::string &link)
+{
+	std::vector<char> target(PATH_MAX + 1, '\0');
+	ssize_t length = readlink(link.c_str(), target.data(), PATH_MAX);
+
+	if (length <= 0)
+	{
+		return std::string();
+	}
+
+	const std::string target_str(target.data(), length);
+
+	if (context.root.empty())
+	{
+		return ((target_str[0] == '/') ? target_str : (context.directory_boot + "/" + target_str));
+	}
+
+	return resolve_in_root(context.root, (target_str[0] == '/') ? target_str : (directory_boot + "/" + target_str));
+}
+
+bool symlink_target_exists(const root_context &context, const std::string &link)
+{
+	const std::string target_path = symlink_target_path(context, link);
+	struct stat buffer;
+
+	return ((!target_path.empty()) && (stat(target_path.c_str(), &buffer) != -1));
+}
+
+// Checks if symlink points to image of kernel selected for removal
+bool symlink_target_queued(const root_context &context, const std::string &link)
+{
+	const std::string target_path = symlink_target_path(context, link);
+
+	for (auto iter = context.kernels_queued.begin(); iter != context.kernels_queued.end(); ++iter)
+	{
+		if ((target_path == context.directory_boot + "/" + prefix_boot_image + *iter)
+			|| (target_path == context.directory_boot + "/" + prefix_boot_image + *iter + ".old"))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Symlink is queued along with kernel files, so it's removed by same workers and /boot is synced only once
+void remove_obsolete_vmlinuzold(root_context &context, const cleaner_options &options, removal_scheduler &scheduler)
+{
+	if (!options.do_not_touch_vmlinuzold)
+	{
+		const std::string vmlinuzold_name = context.directory_boot + "/vmlinuz.old";
+		struct stat buffer;
+
+		if ((lstat(vmlinuzold_name.c_str(), &buffer) != -1)
+			&& (S_ISLNK(buffer.st_mode))
+			&& ((!symlink_target_exists(context, vmlinuzold_name)) || symlink_target_queued(context, vmlinuzold_name)))
+		{
+			queue_file_removal(context, options, scheduler, vmlinuzold_name, false);
+		}
+	}
+}
+
+double seconds_since(const removal_scheduler::clock_type::time_point &start)
+{
+	return std::chrono::duration<double>(removal_scheduler::clock_type::now() - start).count();
+}
+
+// strtoul() alone would accept negative numbers and wrap them around
+bool parse_jobs(const char *value, unsigned int &jobs)
+{
+	char *endptr = NULL;
+
+	if ((value[0] < '0') || (value[0] > '9'))
+	{
+		return false;
+	}
+
+	unsigned long result = strtoul(value, &endptr, 10);
+
+	if ((*endptr != '\0') || (result == 0) || (result > max_jobs_per_device))
+	{
+		return false;
+	}
+
+	jobs = result;
+	return true;
+}
+
+void stop_signal_handler(int)
+{
+	removal_scheduler::request_stop();
+}
+
+// Returns false if removal is stopped before completion. In that case what's left is saved into checkpoint file
+bool run_removal(removal_scheduler &scheduler, const std::optional<removal_scheduler::clock_type::time_point> &deadline, const std::string &checkpoint_file,
+	const progress_options &progress, const std::string &phase)
+{
+	struct sigaction action;
+	struct sigaction old_int_action;
+	struct sigaction old_term_action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_signal_handler;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGINT, &action, &old_int_action);
+	sigaction(SIGTERM, &action, &old_term_action);
+
+	progress_reporter reporter(scheduler, progress, phase);
+
+	bool completed = scheduler.run(deadline);
+
+	reporter.finish(completed);
+
+	sigaction(SIGINT, &old_int_action, NULL);
+	sigaction(SIGTERM, &old_term_action, NULL);
+
+	if (completed)
+	{
+		if ((unlink(checkpoint_file.c_str()) < 0) && (errno != ENOENT))
+		{
+			fprintf(stderr, "Failed to remove file: %s\n", checkpoint_file.c_str());
+		}
+	}
+	else
+	{
+		if ((checkpoint_file == default_checkpoint_file) && (mkdir(default_checkpoint_directory.c_str(), 0700) < 0) && (errno != EEXIST))
+		{
+			fprintf(stderr, "Failed to create directory: %s\n", default_checkpoint_directory.c_str());
+		}
+
+		scheduler.save_pending(checkpoint_file);
+
+		printf("Removal is stopped due to time limit or signal\n");
+		scheduler.print_pending_summary(stdout);
+		printf("Progress is saved to %s, run again to continue\n", checkpoint_file.c_str());
+	}
+
+	return completed;
+}
+
+// Archive is finished as soon as nothing else is going to be archived. Empty archive is not kept
+void finish_archive(std::unique_ptr<archive_writer> &archive)
+{
+	if (!archive)
+	{
+		return;
+	}
+
+	bool finished = archive->finish();
+
+	if (archive->entries() == 0)
+	{
+		unlink(archive->filename().c_str());
+	}
+	else if (finished)
+	{
+		printf("Removed files are archived into %s: %" PRIu64 " entries, %" PRIu64 " bytes\n", archive->filename().c_str(), archive->entries(), archive->bytes_written());
+	}
+
+	archive.reset();
+}
+
+void print_help(const char *name)
+{
+	fprintf(stderr,
+		   "USAGE: %s [options] kernel_version\n"
+		   "Options:\n"
+		   "\t[-h] --help - shows this info\n"
+		   "\t[-l] --list-only - list found kernel versions and exit. Do not specify kernel versions with this option\n"
+		   "\t[-v] --verbose - list found files and also print actions before executing them\n"
+		   "\t[-n] --dryrun - do not execute actions, only print them\n"
+		   "\t[-k] --keep-vmlinuzold - do not remove vmlinuz.old symlink if it becomes obsolete\n"
+		   "\t[-c] --clean-old - remove all kernels except the one currently running\n"
+		   "\t[-s] --keep-sources - keep sources even if no kernel is built out of those sources is present\n"
+		   "\t[-j] --jobs N|auto - number of parallel removals on each device, from 1 to %u, default is 1. Different devices are processed in parallel, by at most %u removal threads in total.\n"
+		   "\t\tWith auto, number of parallel removals is adjusted while removing by measured throughput and latency\n"
+		   "\t--min-jobs N - lower bound of adjusted number of parallel removals, default is 1. Implies --jobs auto, and --jobs N sets initial number\n"
+		   "\t--max-jobs N - upper bound of adjusted number of parallel removals, default is 16. Implies --jobs auto\n"
+		   "\t[-t] --max-duration SECONDS - stop removal between directories when time is over and save what's left into checkpoint file\n"
+		   "\t--checkpoint FILE - file to save interrupted removal into and resume it from, default is %s\n"
+		   "\t--sync - make sure removal is on disk before exiting. Each modified filesystem is synced once when removal on it is done\n"
+		   "\t--stats - print statistics about removal and duration of each phase\n"
+		   "\t--metrics-dir DIR - write metrics in Prometheus text format into DIR/dt_kernel_cleaner.prom, i.e. for node_exporter textfile collector\n"
+		   "\t--progress - show removal progress, throughput and estimated time left in status line on stderr if it's a terminal\n"
+		   "\t--progress-fd N - write removal progress records into already open file descriptor N once per second\n"
+		   "\t[-r] --root DIR - process system root mounted at DIR instead of host system. May be specified multiple times, roots are processed in parallel\n"
+		   "\t--running-kernel VERSION - kernel version considered running by --clean-old for previously specified root, or for host system if no root is specified yet\n"
+		   "\t--roots-file FILE - read roots from FILE, one per line, each optionally followed by running kernel version\n"
+		   "\t--archive FILE - before removing kernel files, save them into new tar.gz archive FILE. Each file is removed only after it's written to archive\n"
+		   "\t--archive-sources - also save kernel sources into archive specified with --archive\n"
+		   "\t--prune-sources - remove build files (*.o, *.ko, *.cmd, .tmp_*) from kernel sources which are not removed. Files needed to build external modules are kept\n"
+		   "\n"
+		   "\tkernel version is in format d.d.d-revision or just d.d.d (number of digits is variable)\n"
+		   "\tIf removal was interrupted, it's resumed from checkpoint file before any other action\n",
+		   name, max_jobs_per_device, max_removal_threads, default_checkpoint_file.c_str());
+}
+
+int main(int argc, char **argv)
+{
+	const auto start_time = removal_scheduler::clock_type::now();
+
+	try
+	{
+		cleaner_options options;
+		bool help = false;
+		unsigned int jobs_per_device = 1;
+		bool jobs_specified = false;
+		bool adaptive_jobs = false;
+		unsigned int min_jobs = 1;
+		unsigned int max_jobs = 16;
+		std::optional<removal_scheduler::clock_type::time_point> deadline;
+		std::string checkpoint_file = default_checkpoint_file;
+		std::string metrics_dir;
+		bool print_stats = false;
+		progress_options progress;
+
+		std::list<std::pair<std::string, std::optional<version_info> > > roots;
+		std::optional<version_info> host_running_kernel;
+		std::string archive_file;
+
+		for (int i = 1; i < argc; ++i)
+		{
+			if ((strcmp(argv[i],"--help") == 0) || (strcmp(argv[i], "-h") == 0))
+			{
+				help = true;
+			}
+			else if ((strcmp(argv[i],"--list-only") == 0) || (strcmp(argv[i], "-l") == 0))
+			{
+				options.list_only = true;
+			}
+			else if ((strcmp(argv[i],"--verbose") == 0) || (strcmp(argv[i], "-v") == 0))
+			{
+				options.verbose = true;
+			}
+			else if ((strcmp(argv[i],"--dryrun") == 0) || (strcmp(argv[i], "-n") == 0))
+			{
+				options.dry_run = true;
+			}
+			else if ((strcmp(argv[i],"--keep-vmlinuzold") == 0) || (strcmp(argv[i], "-k") == 0))
+			{
+				options.do_not_touch_vmlinuzold = true;
+			}
+			else if ((strcmp(argv[i],"--clean-old") == 0) || (strcmp(argv[i], "-c") == 0))
+			{
+				options.clean_old = true;
+			}
+			else if ((strcmp(argv[i],"--keep-sources") == 0) || (strcmp(argv[i], "-s") == 0))
+			{
+				options.keep_sources = true;
+			}
+			else if ((strcmp(argv[i],"--jobs") == 0) || (strcmp(argv[i], "-j") == 0))
+			{
+				if ((i + 1 < argc) && (strcmp(argv[i + 1], "auto") == 0))
+				{
+					adaptive_jobs = true;
+					jobs_specified = false;
+				}
+				else if ((i + 1 >= argc) || (!parse_jobs(argv[i + 1], jobs_per_device)))
+				{
+					fprintf(stderr, "Option %s requires number of jobs from 1 to %u or auto, try %s --help for more information\n", argv[i], max_jobs_per_device, argv[0]);
+					return 0;
+				}
+				else
+				{
+					jobs_specified = true;
+				}
+
+				++i;
+			}
+			else if ((strcmp(argv[i],"--min-jobs") == 0) || (strcmp(argv[i],"--max-jobs") == 0))
+			{
+				unsigned int jobs;
+
+				if ((i + 1 >= argc) || (!parse_jobs(argv[i + 1], jobs)))
+				{
+					fprintf(stderr, "Option %s requires number of jobs from 1 to %u, try %s --help for more information\n", argv[i], max_jobs_per_device, argv[0]);
+					return 0;
+				}
+
+				if (strcmp(argv[i],"--min-jobs") == 0)
+				{
+					min_jobs = jobs;
+				}
+				else
+				{
+					max_jobs = jobs;
+				}
+
+				adaptive_jobs = true;
+				++i;
 			}
+			else if ((strcmp(argv[i],"--max-duration") == 0) || (strcmp(argv[i], "-t") == 0))
+			{
+				char *endptr = NULL;
+				unsigned long seconds;
 
-			auto kernel_version_iter = selected_kernels.begin();
-			auto kernel_version_iter_end = selected_kernels.end();
+				if ((i + 1 >= argc) || ((seconds = strtoul(argv[i + 1], &endptr, 10)) == 0) || (*endptr != '\0'))
+				{
+					fprintf(stderr, "Option %s requires positive number of seconds, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
+				}
 
-			for (; kernel_version_iter != kernel_version_iter_end; ++kernel_version_iter)
+				deadline = start_time + std::chrono::seconds(seconds);
+				++i;
+			}
+			else if (strcmp(argv[i],"--checkpoint") == 0)
 			{
-				bool found_kernels_matched = false;
-				std::set<version_info> found_kernels;
-				std::optional<version_info> found_kernel_sources;
-
+				if ((i + 1 >= argc) || (argv[i + 1][0] == '\0'))
 				{
-					std::vector<version_info_type> version_vector = kernel_version_iter->version;
-					std::string revision_and_local_version_string = kernel_version_iter->revision + kernel_version_iter->local_version;
+					fprintf(stderr, "Option %s requires file name, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
+				}
 
-					auto kernel_version = kernel_versions_tree.find(version_vector);
-					if (kernel_version != kernel_versions_tree.end())
-					{
-						auto kernel_revision = kernel_version->second.begin();
-						auto kernel_revision_end = kernel_version->second.end();
+				checkpoint_file = argv[i + 1];
+				++i;
+			}
+			else if (strcmp(argv[i],"--sync") == 0)
+			{
+				options.sync = true;
+			}
+			else if (strcmp(argv[i],"--stats") == 0)
+			{
+				print_stats = true;
+			}
+			else if (strcmp(argv[i],"--progress") == 0)
+			{
+				progress.status_line = true;
+			}
+			else if (strcmp(argv[i],"--progress-fd") == 0)
+			{
+				char *endptr = NULL;
+				long fd;
 
-						for ( ; kernel_revision != kernel_revision_end; ++kernel_revision)
-						{
-							if (kernel_revision->first.compare(0, std::string::npos, revision_and_local_version_string, 0, kernel_revision->first.length()) == 0)
-							{
-								std::string kernel_local_version_string = revision_and_local_version_string.substr(kernel_revision->first.length());
-
-								auto kernel_local_version = kernel_revision->second.find(kernel_local_version_string);
-								if (kernel_local_version != kernel_revision->second.end())
-								{
-									found_kernels.insert(version_info(version_vector, kernel_revision->first, kernel_local_version_string));
-									found_kernels_matched = true;
-									break;
-								}
-							}
-						}
-					}
+				if ((i + 1 >= argc) || ((fd = strtol(argv[i + 1], &endptr, 10)) < 0) || (fd > INT_MAX) || (*endptr != '\0') || (endptr == argv[i + 1]))
+				{
+					fprintf(stderr, "Option %s requires file descriptor number, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
+				}
 
-					auto kernel_src_version = kernel_src_versions.find(version_vector);
-					if (kernel_src_version != kernel_src_versions.end())
-					{
-						auto kernel_src_revision = kernel_src_version->second.begin();
-						auto kernel_src_revision_end = kernel_src_version->second.end();
+				if (fcntl((int) fd, F_GETFD) < 0)
+				{
+					fprintf(stderr, "Error: file descriptor %ld specified with option %s is not open\n", fd, argv[i]);
+					return -1;
+				}
 
-						for ( ; kernel_src_revision != kernel_src_revision_end; ++kernel_src_revision)
-						{
-							if (*kernel_src_revision == revision_and_local_version_string)
-							{
-								found_kernel_sources = version_info(version_vector, revision_and_local_version_string);
-								break;
-							}
-						}
-					}
+				progress.fd = (int) fd;
+				++i;
+			}
+			else if (strcmp(argv[i],"--metrics-dir") == 0)
+			{
+				if ((i + 1 >= argc) || (argv[i + 1][0] == '\0'))
+				{
+					fprintf(stderr, "Option %s requires directory name, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
 				}
 
-				// If kernel not found, then kernel sources are removed. Find all kernels built from this source and remove them.
-				// They'll have same version and revision and different local version
-				if (found_kernels.empty() && found_kernel_sources)
+				metrics_dir = argv[i + 1];
+				++i;
+			}
+			else if ((strcmp(argv[i],"--root") == 0) || (strcmp(argv[i], "-r") == 0))
+			{
+				if ((i + 1 >= argc) || (argv[i + 1][0] == '\0'))
 				{
-					std::vector<version_info_type> version_vector = found_kernel_sources->version;
+					fprintf(stderr, "Option %s requires directory name, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
+				}
 
-					auto kernel_version = kernel_versions_tree.find(version_vector);
-					if (kernel_version != kernel_versions_tree.end())
-					{
-						auto kernel_revision = kernel_version->second.find(found_kernel_sources->revision);
-						if (kernel_revision != kernel_version->second.end())
-						{
-							auto kernel_local_version_iter = kernel_revision->second.begin();
-							auto kernel_local_version_end = kernel_revision->second.end();
+				roots.push_back(std::make_pair(normalize_root(argv[i + 1]), std::optional<version_info>()));
+				++i;
+			}
+			else if (strcmp(argv[i],"--running-kernel") == 0)
+			{
+				std::optional<version_info> version;
 
-							for ( ; kernel_local_version_iter != kernel_local_version_end; ++kernel_local_version_iter)
-							{
-								found_kernels.insert(version_info(found_kernel_sources->version, found_kernel_sources->revision, *kernel_local_version_iter));
-							}
-						}
-					}
+				if ((i + 1 >= argc) || (!(version = parse_kernel_version(argv[i + 1]))))
+				{
+					fprintf(stderr, "Option %s requires kernel version, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
 				}
 
-				for (auto found_kernel_iter = found_kernels.begin(); found_kernel_iter != found_kernels.end(); ++found_kernel_iter)
+				if (roots.empty())
+				{
+					host_running_kernel = version;
+				}
+				else
 				{
-					std::string version_str = found_kernel_iter->toString();
-					printf("Removing kernel version %s\n", version_str.c_str());
+					roots.back().second = version;
+				}
 
-					struct stat buffer;
+				++i;
+			}
+			else if (strcmp(argv[i],"--archive") == 0)
+			{
+				if ((i + 1 >= argc) || (argv[i + 1][0] == '\0'))
+				{
+					fprintf(stderr, "Option %s requires file name, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
+				}
 
-					std::set<std::string> found_files;
-					std::set<std::string> directories;
+				archive_file = argv[i + 1];
+				options.archive = true;
+				++i;
+			}
+			else if (strcmp(argv[i],"--archive-sources") == 0)
+			{
+				options.archive_sources = true;
+			}
+			else if (strcmp(argv[i],"--prune-sources") == 0)
+			{
+				options.prune_sources = true;
+			}
+			else if (strcmp(argv[i],"--roots-file") == 0)
+			{
+				if ((i + 1 >= argc) || (argv[i + 1][0] == '\0'))
+				{
+					fprintf(stderr, "Option %s requires file name, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
+				}
 
-					find_all_files_and_dirs(directory_modules + "/" + version_str, found_files, directories);
+				read_roots_file(argv[i + 1], roots);
+				++i;
+			}
+			else
+			{
+				std::cmatch reg_results;
 
-					// clean everything in /boot
-					if (verbose)
-					{
-						printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_config + version_str).c_str());
-					}
+				if (std::regex_match(argv[i], reg_results, std::regex(regex_input_capture)))
+				{
+					version_info version(convertStringToVersion(reg_results.str(1)), reg_results.str(2));
 
-					if (!dry_run)
+					if (options.selected_kernels.find(version) == options.selected_kernels.end())
 					{
-						remove_file(directory_boot + "/" + prefix_boot_config + version_str);
+						options.selected_kernels.insert(version);
 					}
-
-					if (verbose)
+					else
 					{
-						printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_map + version_str).c_str());
+						fprintf(stderr, "Kernel version is specified multiple times: %s\n", version.toString().c_str());
+						return 0;
 					}
+				}
+				else
+				{
+					fprintf(stderr, "Unknown option or invalid format of kernel version: %s, try %s --help for more information\n", argv[i], argv[0]);
+					return 0;
+				}
+			}
+		}
 
-					if (!dry_run)
-					{
-						remove_file(directory_boot + "/" + prefix_boot_map + version_str);
-					}
+		if (help)
+		{
+			print_help(argv[0]);
+			return 0;
+		}
 
-					if (verbose)
-					{
-						printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_image + version_str).c_str());
-					}
+		if ((!options.list_only) && options.selected_kernels.empty() && (!options.clean_old) && (!options.prune_sources))
+		{
+			fprintf(stderr, "Error: no kernel versions or other actions are specified. Try %s --help for more information\n", argv[0]);
+			return -1;
+		}
 
-					if (!dry_run)
-					{
-						remove_file(directory_boot + "/" + prefix_boot_image + version_str);
-					}
+		if (options.list_only && (((!options.selected_kernels.empty()) && options.clean_old) || options.prune_sources))
+		{
+			fprintf(stderr, "Error: too much incompatible action options are specified. Try %s --help for more information\n", argv[0]);
+			return -1;
+		}
 
-					if (stat((directory_boot + "/" + prefix_boot_initramfs + version_str + ".img").c_str(), &buffer) != -1)
-					{
-						if (verbose)
-						{
-							printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_initramfs + version_str + ".img").c_str());
-						}
+		if (roots.empty())
+		{
+			roots.push_back(std::make_pair(std::string(), host_running_kernel));
+		}
+		else if (host_running_kernel)
+		{
+			fprintf(stderr, "Error: running kernel version is specified for host system, but only other roots are processed. Try %s --help for more information\n", argv[0]);
+			return -1;
+		}
 
-						if (!dry_run)
-						{
-							remove_file(directory_boot + "/" + prefix_boot_initramfs + version_str + ".img");
-						}
-					}
+		{
+			std::set<std::string> unique_roots;
 
-					if (stat((directory_boot + "/" + prefix_boot_config + version_str + ".old").c_str(), &buffer) != -1)
-					{
-						if (verbose)
-						{
-							printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_config + version_str + ".old").c_str());
-						}
+			for (auto iter = roots.begin(); iter != roots.end(); ++iter)
+			{
+				if (!unique_roots.insert(iter->first).second)
+				{
+					fprintf(stderr, "Root is specified multiple times: %s\n", iter->first.empty() ? "/" : iter->first.c_str());
+					return 0;
+				}
 
-						if (!dry_run)
-						{
-							remove_file(directory_boot + "/" + prefix_boot_config + version_str + ".old");
-						}
-					}
+				struct stat buffer;
 
-					if (stat((directory_boot + "/" + prefix_boot_map + version_str + ".old").c_str(), &buffer) != -1)
-					{
-						if (verbose)
-						{
-							printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_map + version_str + ".old").c_str());
-						}
+				if ((!iter->first.empty()) && ((stat(iter->first.c_str(), &buffer) == -1) || (!S_ISDIR(buffer.st_mode))))
+				{
+					fprintf(stderr, "Root is not a directory: %s\n", iter->first.c_str());
+					return 0;
+				}
+			}
+		}
 
-						if (!dry_run)
-						{
-							remove_file(directory_boot + "/" + prefix_boot_map + version_str + ".old");
-						}
-					}
+		if (adaptive_jobs && (min_jobs > max_jobs))
+		{
+			fprintf(stderr, "Error: minimal number of jobs is greater than maximal one. Try %s --help for more information\n", argv[0]);
+			return -1;
+		}
 
-					if (stat((directory_boot + "/" + prefix_boot_image + version_str + ".old").c_str(), &buffer) != -1)
-					{
-						if (verbose)
-						{
-							printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_image + version_str + ".old").c_str());
-						}
+		// with bounds, number of jobs is used as initial one
+		if (adaptive_jobs)
+		{
+			if (!jobs_specified)
+			{
+				jobs_per_device = min_jobs;
+			}
+			else if ((jobs_per_device < min_jobs) || (jobs_per_device > max_jobs))
+			{
+				fprintf(stderr, "Error: number of jobs is outside of bounds set with --min-jobs and --max-jobs. Try %s --help for more information\n", argv[0]);
+				return -1;
+			}
+		}
 
-						if (!dry_run)
-						{
-							remove_file(directory_boot + "/" + prefix_boot_image + version_str + ".old");
-						}
-					}
+		if (options.archive_sources && (!options.archive))
+		{
+			fprintf(stderr, "Error: option --archive-sources requires option --archive. Try %s --help for more information\n", argv[0]);
+			return -1;
+		}
 
-					if (stat((directory_boot + "/" + prefix_boot_initramfs + version_str + ".img.old").c_str(), &buffer) != -1)
-					{
-						if (verbose)
-						{
-							printf("Removing file %s\n", (directory_boot + "/" + prefix_boot_initramfs + version_str + ".img.old").c_str());
-						}
+		// all kept kernel sources are needed for pruning
+		options.full_inventory = (!metrics_dir.empty()) || options.prune_sources;
+		options.measure_reclaimable = (!metrics_dir.empty());
 
-						if (!dry_run)
-						{
-							remove_file(directory_boot + "/" + prefix_boot_initramfs + version_str + ".img.old");
-						}
-					}
+		run_metrics metrics;
+		metrics.dry_run = options.dry_run;
 
-					// clean everything in /lib/modules
-					if (verbose)
-					{
-						printf("Recursively removing directory %s\n", (directory_modules + "/" + version_str).c_str());
-					}
+		auto save_metrics = [&metrics_dir, &metrics, print_stats]()
+		{
+			if (print_stats)
+			{
+				print_statistics(stdout, metrics);
+			}
 
-					if (!dry_run)
-					{
-						auto files_end = found_files.end();
-						for (auto files_cur = found_files.begin(); files_cur != files_end; ++files_cur)
-						{
-							remove_file(*files_cur);
-						}
+			if (!metrics_dir.empty())
+			{
+				write_metrics_file(metrics_dir, metrics);
+			}
+		};
 
-						// go in reverse order to make sure that top-most directories are removed last
-						auto dirs_end = directories.rend();
-						for (auto dirs_cur = directories.rbegin(); dirs_cur != dirs_end; ++dirs_cur)
-						{
-							remove_directory(*dirs_cur);
-						}
-					}
+		std::unique_ptr<archive_writer> archive;
+
+		if (options.archive && (!options.list_only) && (!options.dry_run))
+		{
+			archive.reset(new archive_writer(archive_file, std::max(1u, std::thread::hardware_concurrency())));
+		}
+
+		auto phase_start = removal_scheduler::clock_type::now();
 
-					// remove kernel from lists
-					kernel_versions_tree[found_kernel_iter->version][found_kernel_iter->revision].erase(found_kernel_iter->local_version);
+		// Finish removal interrupted last time before looking for kernels, otherwise half-removed directories would be found again
+		if ((!options.list_only) && (access(checkpoint_file.c_str(), F_OK) == 0))
+		{
+			if (options.dry_run)
+			{
+				printf("Interrupted removal saved in %s would be resumed\n", checkpoint_file.c_str());
+			}
+			else
+			{
+				printf("Resuming interrupted removal saved in %s\n", checkpoint_file.c_str());
+
+				removal_scheduler scheduler(jobs_per_device, options.sync, archive.get());
+
+				if (adaptive_jobs)
+				{
+					scheduler.set_adaptive_jobs(min_jobs, max_jobs);
 				}
 
-				if ((!keep_sources)
-					&& ((found_kernels_matched
-							&& kernel_versions_tree[found_kernels.begin()->version][found_kernels.begin()->revision].empty()
-							&& (kernel_src_versions.find(found_kernels.begin()->version) != kernel_src_versions.end()))
-						|| ((!found_kernels_matched) && found_kernel_sources)))
+				// only files of roots processed now may be removed
+				std::list<std::string> allowed_directories;
+
+				for (auto iter = roots.begin(); iter != roots.end(); ++iter)
 				{
-					std::string version_str;
+					root_context context(iter->first, iter->second);
 
-					if (found_kernels_matched)
-					{
-						version_str = versionToString(found_kernels.begin()->version) + found_kernels.begin()->revision;
-					}
-					else
+					// broken root is reported when it's scanned
+					if (context.error)
 					{
-						version_str = found_kernel_sources->toString();
+						continue;
 					}
 
-					printf("Removing kernel sources version %s\n", version_str.c_str());
+					allowed_directories.push_back(context.directory_boot);
+					allowed_directories.push_back(context.directory_modules);
+					allowed_directories.push_back(context.directory_src);
+				}
 
-					std::set<std::string> found_files;
-					std::set<std::string> directories;
+				scheduler.load_pending(checkpoint_file, allowed_directories);
 
-					find_all_files_and_dirs(directory_src + "/" + prefix_src + version_str, found_files, directories);
+				metrics.completed = run_removal(scheduler, deadline, checkpoint_file, progress, "resume");
+				metrics.statistics += scheduler.statistics();
+				metrics.concurrency.insert(metrics.concurrency.end(), scheduler.concurrency().begin(), scheduler.concurrency().end());
+				metrics.phase_durations.push_back(std::make_pair("resume", seconds_since(phase_start)));
 
-					// clean everything in /usr/src
-					if (verbose)
-					{
-						printf("Recursively removing directory %s\n", (directory_src + "/" + prefix_src + version_str).c_str());
-					}
+				if (!metrics.completed)
+				{
+					finish_archive(archive);
+					save_metrics();
+					return 0;
+				}
+			}
+		}
 
-					if (!dry_run)
-					{
-						auto files_end = found_files.end();
-						for (auto files_cur = found_files.begin(); files_cur != files_end; ++files_cur)
-						{
-							remove_file(*files_cur);
-						}
+		phase_start = removal_scheduler::clock_type::now();
 
-						// go in reverse order to make sure that top-most directories are removed last
-						auto dirs_end = directories.rend();
-						for (auto dirs_cur = directories.rbegin(); dirs_cur != dirs_end; ++dirs_cur)
-						{
-							remove_directory(*dirs_cur);
-						}
-					}
+		removal_scheduler scheduler(jobs_per_device, options.sync, archive.get());
+		std::list<root_context> contexts;
+
+		if (adaptive_jobs)
+		{
+			scheduler.set_adaptive_jobs(min_jobs, max_jobs);
+		}
+
+		for (auto iter = roots.begin(); iter != roots.end(); ++iter)
+		{
+			contexts.emplace_back(iter->first, iter->second);
+			contexts.back().statistics_group = scheduler.add_group();
+		}
+
+		scan_roots(contexts, options, scheduler);
+
+		metrics.phase_durations.push_back(std::make_pair("scan", seconds_since(phase_start)));
+
+		bool root_failed = false;
+
+		auto collect_installed_versions = [&metrics, &contexts]()
+		{
+			for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
+			{
+				metrics.kernels[iter->name()] = iter->kernels;
+				metrics.kernel_sources[iter->name()] = iter->kernel_sources;
+			}
+		};
+
+		collect_installed_versions();
+
+		for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
+		{
+			if (iter->error)
+			{
+				root_failed = true;
+			}
+		}
+
+		if (!options.list_only)
+		{
+			for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
+			{
+				if (!iter->error)
+				{
+					remove_obsolete_vmlinuzold(*iter, options, scheduler);
 				}
 			}
 
-			// TODO: this currently does not work in dry-run, i.e. it does not show that it would remove the symlink due to file it points to not being removed
-			if (!do_not_touch_vmlinuzold)
+			metrics.reclaimable_bytes = 0;
+
+			for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
 			{
-				const std::string vmlinuzold_name = "/boot/vmlinuz.old";
-				struct stat buffer;
+				*(metrics.reclaimable_bytes) += iter->reclaimable_bytes;
+			}
+
+			if (!options.dry_run)
+			{
+				phase_start = removal_scheduler::clock_type::now();
+
+				metrics.completed = run_removal(scheduler, deadline, checkpoint_file, progress, "removal");
+				metrics.statistics += scheduler.statistics();
+				metrics.concurrency.insert(metrics.concurrency.end(), scheduler.concurrency().begin(), scheduler.concurrency().end());
+				metrics.phase_durations.push_back(std::make_pair("removal", seconds_since(phase_start)));
+
+				finish_archive(archive);
 
-				if ((lstat(vmlinuzold_name.c_str(), &buffer) != -1)
-					&& (S_ISLNK(buffer.st_mode))
-					&& (stat(vmlinuzold_name.c_str(), &buffer) == -1))
+				for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
 				{
-					if (verbose)
-					{
-						printf("Removing file %s\n", vmlinuzold_name.c_str());
-					}
+					update_installed_versions(*iter);
+				}
 
-					if (!dry_run)
-					{
-						remove_file(vmlinuzold_name);
-					}
+				collect_installed_versions();
+
+				if (!metrics.completed)
+				{
+					save_metrics();
+					return 0;
 				}
 			}
+
+			if ((contexts.size() > 1) || (!contexts.front().root.empty()))
+			{
+				print_roots_summary(contexts, options, scheduler);
+			}
+		}
+
+		save_metrics();
+
+		if (root_failed)
+		{
+			return -1;
 		}
 	}
 	catch (const std::exception &exc)
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+const std::string metrics_file_name = "dt_kernel_cleaner.prom";
+const std::string metrics_prefix = "dt_kernel_cleaner_";
+
+static std::string escape_label_value(const std::string &value)
+{
+	std::string result;
+
+	for (auto iter = value.begin(); iter != value.end(); ++iter)
+	{
+		if ((*iter == '\\') || (*iter == '"'))
+		{
+			result.push_back('\\');
+		}
+
+		result.push_back(*iter);
+	}
+
+	return result;
+}
+
+// Only unlabeled counters are needed, other lines are ignored
+static std::map<std::string, uint64_t> read_previous_counters(const std::string &filename)
+{
+	std::map<std::string, uint64_t> counters;
+	std::ifstream file(filename);
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		size_t pos = line.find(' ');
+
+		if ((line.compare(0, metrics_prefix.length(), metrics_prefix) == 0)
+			&& (pos != std::string::npos)
+			&& (line.compare(pos - 6, 6, "_total") == 0))
+		{
+			counters[line.substr(0, pos)] = strtoull(line.c_str() + pos + 1, NULL, 10);
+		}
+	}
+
+	return counters;
+}
+
+static void write_metric_header(FILE *file, const std::string &name, const char *type, const char *help)
+{
+	fprintf(file, "# HELP %s%s %s\n", metrics_prefix.c_str(), name.c_str(), help);
+	fprintf(file, "# TYPE %s%s %s\n", metrics_prefix.c_str(), name.c_str(), type);
+}
+
+static void write_gauge(FILE *file, const std::string &name, const char *help, uint64_t value)
+{
+	write_metric_header(file, name, "gauge", help);
+	fprintf(file, "%s%s %" PRIu64 "\n", metrics_prefix.c_str(), name.c_str(), value);
+}
+
+static void write_counter(FILE *file, std::map<std::string, uint64_t> &previous_counters, const std::string &name, const char *help, uint64_t value)
+{
+	write_metric_header(file, name, "counter", help);
+	fprintf(file, "%s%s %" PRIu64 "\n", metrics_prefix.c_str(), name.c_str(), previous_counters[metrics_prefix + name] + value);
+}
+
+static void write_version_set(FILE *file, const std::string &name, const char *help, const std::map<std::string, std::set<std::string> > &versions)
+{
+	write_metric_header(file, name, "gauge", help);
+
+	for (auto root_iter = versions.begin(); root_iter != versions.end(); ++root_iter)
+	{
+		for (auto iter = root_iter->second.begin(); iter != root_iter->second.end(); ++iter)
+		{
+			fprintf(file, "%s%s{root=\"%s\",version=\"%s\"} 1\n", metrics_prefix.c_str(), name.c_str(), escape_label_value(root_iter->first).c_str(), escape_label_value(*iter).c_str());
+		}
+	}
+}
+
+static void write_version_count(FILE *file, const std::string &name, const char *help, const std::map<std::string, std::set<std::string> > &versions)
+{
+	write_metric_header(file, name, "gauge", help);
+
+	for (auto iter = versions.begin(); iter != versions.end(); ++iter)
+	{
+		fprintf(file, "%s%s{root=\"%s\"} %zu\n", metrics_prefix.c_str(), name.c_str(), escape_label_value(iter->first).c_str(), iter->second.size());
+	}
+}
+
+void write_metrics_file(const std::string &directory, const run_metrics &metrics)
+{
+	const std::string filename = directory + "/" + metrics_file_name;
+	const std::string temp_filename = filename + ".tmp";
+
+	std::map<std::string, uint64_t> previous_counters = read_previous_counters(filename);
+
+	FILE *file = fopen(temp_filename.c_str(), "w");
+	if (file == NULL)
+	{
+		throw std::runtime_error("Failed to create file: " + temp_filename);
+	}
+
+	write_version_set(file, "kernel_installed", "Kernel version with files present in /boot or /lib/modules", metrics.kernels);
+	write_version_count(file, "kernel_installed_count", "Number of kernel versions with files present in /boot or /lib/modules", metrics.kernels);
+	write_version_set(file, "kernel_sources_installed", "Kernel source tree version present in /usr/src", metrics.kernel_sources);
+	write_version_count(file, "kernel_sources_installed_count", "Number of kernel source trees present in /usr/src", metrics.kernel_sources);
+
+	write_gauge(file, "last_run_timestamp_seconds", "Time when last run finished", static_cast<uint64_t>(time(NULL)));
+	write_gauge(file, "last_run_completed", "Whether last run removed everything it was going to remove", metrics.completed ? 1 : 0);
+	write_gauge(file, "last_run_dry_run", "Whether last run was a dry run", metrics.dry_run ? 1 : 0);
+
+	if (metrics.reclaimable_bytes)
+	{
+		write_gauge(file, "last_run_reclaimable_bytes", "Disk space occupied by files selected for removal during last run, including dry run", *(metrics.reclaimable_bytes));
+	}
+
+	write_gauge(file, "last_run_reclaimed_bytes", "Disk space freed during last run", metrics.statistics.bytes_removed);
+	write_gauge(file, "last_run_files_removed", "Files removed during last run", metrics.statistics.files_removed);
+	write_gauge(file, "last_run_directories_removed", "Directories removed during last run", metrics.statistics.directories_removed);
+	write_gauge(file, "last_run_removal_failures", "Files and directories which failed to be removed during last run", metrics.statistics.failures);
+	write_gauge(file, "last_run_syncs", "Filesystems synced during last run", metrics.statistics.syncs);
+
+	write_metric_header(file, "last_run_sync_duration_seconds", "gauge", "Time spent syncing filesystems during last run");
+	fprintf(file, "%slast_run_sync_duration_seconds %.6f\n", metrics_prefix.c_str(), metrics.statistics.sync_microseconds / 1000000.0);
+
+	write_metric_header(file, "last_run_phase_duration_seconds", "gauge", "Duration of each phase of last run");
+
+	for (auto iter = metrics.phase_durations.begin(); iter != metrics.phase_durations.end(); ++iter)
+	{
+		fprintf(file, "%slast_run_phase_duration_seconds{phase=\"%s\"} %.6f\n", metrics_prefix.c_str(), escape_label_value(iter->first).c_str(), iter->second);
+	}
+
+	write_counter(file, previous_counters, "runs_total", "Number of runs", 1);
+	write_counter(file, previous_counters, "reclaimed_bytes_total", "Disk space freed", metrics.statistics.bytes_removed);
+	write_counter(file, previous_counters, "files_removed_total", "Files removed", metrics.statistics.files_removed);
+	write_counter(file, previous_counters, "directories_removed_total", "Directories removed", metrics.statistics.directories_removed);
+	write_counter(file, previous_counters, "removal_failures_total", "Files and directories which failed to be removed", metrics.statistics.failures);
+
+	bool failed = (ferror(file) != 0);
+
+	if ((fclose(file) != 0) || failed || (rename(temp_filename.c_str(), filename.c_str()) != 0))
+	{
+		unlink(temp_filename.c_str());
+		throw std::runtime_error("Failed to write file: " + filename);
+	}
+}
+
+void print_statistics(FILE *stream, const run_metrics &metrics)
+{
+	fprintf(stream, "\nStatistics:\n");
+	fprintf(stream, "\tfiles selected for removal: %" PRIu64 " (%" PRIu64 " bytes)\n", metrics.statistics.files_found, metrics.statistics.bytes_found);
+	fprintf(stream, "\tfiles removed: %" PRIu64 " (%" PRIu64 " bytes)\n", metrics.statistics.files_removed, metrics.statistics.bytes_removed);
+	fprintf(stream, "\tdirectories removed: %" PRIu64 "\n", metrics.statistics.directories_removed);
+	fprintf(stream, "\tremoval failures: %" PRIu64 "\n", metrics.statistics.failures);
+	fprintf(stream, "\tfilesystems synced: %" PRIu64 " (%.3f seconds)\n", metrics.statistics.syncs, metrics.statistics.sync_microseconds / 1000000.0);
+
+	for (auto iter = metrics.phase_durations.begin(); iter != metrics.phase_durations.end(); ++iter)
+	{
+		fprintf(stream, "\t%s phase: %.3f seconds\n", iter->first.c_str(), iter->second);
+	}
+
+	for (auto iter = metrics.concurrency.begin(); iter != metrics.concurrency.end(); ++iter)
+	{
+		fprintf(stream, "\tdevice %u:%u (%s): ", major(iter->device), minor(iter->device), iter->directory.c_str());
+
+		if (iter->adaptive)
+		{
+			fprintf(stream, "adaptive jobs %u at the end, %u..%u used, %.1f on average, %" PRIu64 " adjustments",
+				iter->final_jobs, iter->min_jobs_used, iter->max_jobs_used, iter->average_jobs, iter->adjustments);
+		}
+		else
+		{
+			fprintf(stream, "fixed jobs %u", iter->final_jobs);
+		}
+
+		fprintf(stream, ", %" PRIu64 " removals in %.3f seconds (%.0f per second), average latency %.3f ms\n",
+			iter->removals, iter->seconds,
+			(iter->seconds > 0) ? (iter->removals / iter->seconds) : 0.0,
+			(iter->removals > 0) ? (iter->removal_microseconds / 1000.0 / iter->removals) : 0.0);
+	}
+}
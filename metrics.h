@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DT_KERNEL_CLEANER_METRICS_H
+#define DT_KERNEL_CLEANER_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <list>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "removal.h"
+
+struct run_metrics
+{
+	//       root,        installed versions
+	std::map<std::string, std::set<std::string> > kernels;
+	std::map<std::string, std::set<std::string> > kernel_sources;
+
+	//                    phase name,  duration in seconds
+	std::list<std::pair<std::string, double> > phase_durations;
+
+	// space occupied by files selected for removal, counted before removal. Not set if nothing was selected, i.e. for listing
+	std::optional<uint64_t> reclaimable_bytes;
+
+	removal_statistics statistics;
+	std::list<concurrency_statistics> concurrency;
+	bool completed = true;
+	bool dry_run = false;
+};
+
+// Writes metrics in Prometheus text format into file in specified directory, i.e. for node_exporter textfile collector.
+// File is replaced atomically. Counters are accumulated over runs by adding values from previously written file
+void write_metrics_file(const std::string &directory, const run_metrics &metrics);
+
+void print_statistics(FILE *stream, const run_metrics &metrics);
+
+#endif /* DT_KERNEL_CLEANER_METRICS_H */
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DT_KERNEL_CLEANER_PROBES_H
+#define DT_KERNEL_CLEANER_PROBES_H
+
+// USDT probes of provider dt_kernel_cleaner, i.e. for bpftrace or SystemTap.
+// Enabled probe is single nop instruction until tracer attaches to it.
+// Only pointers and integers which are already computed are passed as arguments, so probes cost nothing when not traced.
+// If sys/sdt.h is not available, probes are not compiled at all
+
+#if defined(DT_KERNEL_CLEANER_USDT)
+
+#include <sys/sdt.h>
+
+#define DT_KERNEL_CLEANER_PROBE1(name, arg1) DTRACE_PROBE1(dt_kernel_cleaner, name, arg1)
+#define DT_KERNEL_CLEANER_PROBE2(name, arg1, arg2) DTRACE_PROBE2(dt_kernel_cleaner, name, arg1, arg2)
+#define DT_KERNEL_CLEANER_PROBE3(name, arg1, arg2, arg3) DTRACE_PROBE3(dt_kernel_cleaner, name, arg1, arg2, arg3)
+#define DT_KERNEL_CLEANER_PROBE6(name, arg1, arg2, arg3, arg4, arg5, arg6) DTRACE_PROBE6(dt_kernel_cleaner, name, arg1, arg2, arg3, arg4, arg5, arg6)
+
+#else /* defined(DT_KERNEL_CLEANER_USDT) */
+
+#define DT_KERNEL_CLEANER_PROBE1(name, arg1) do { } while (0)
+#define DT_KERNEL_CLEANER_PROBE2(name, arg1, arg2) do { } while (0)
+#define DT_KERNEL_CLEANER_PROBE3(name, arg1, arg2, arg3) do { } while (0)
+#define DT_KERNEL_CLEANER_PROBE6(name, arg1, arg2, arg3, arg4, arg5, arg6) do { } while (0)
+
+#endif /* defined(DT_KERNEL_CLEANER_USDT) */
+
+#endif /* DT_KERNEL_CLEANER_PROBES_H */
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "progress.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Status line is redrawn few times per second, records are written once per second
+static const std::chrono::milliseconds status_line_interval(250);
+static const std::chrono::milliseconds record_interval(1000);
+
+// Weight of newest rate measurement in smoothed rates
+static const double rate_smoothing = 0.3;
+
+static std::string format_size(uint64_t bytes)
+{
+	static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+
+	double value = bytes;
+	size_t unit = 0;
+
+	while ((value >= 1024) && (unit + 1 < sizeof(units) / sizeof(units[0])))
+	{
+		value /= 1024;
+		++unit;
+	}
+
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), (unit == 0) ? "%.0f %s" : "%.1f %s", value, units[unit]);
+
+	return buffer;
+}
+
+static std::string format_duration(double seconds)
+{
+	uint64_t total = (uint64_t) (seconds + 0.5);
+
+	char buffer[32];
+
+	if (total >= 3600)
+	{
+		snprintf(buffer, sizeof(buffer), "%" PRIu64 ":%02" PRIu64 ":%02" PRIu64, total / 3600, (total / 60) % 60, total % 60);
+	}
+	else
+	{
+		snprintf(buffer, sizeof(buffer), "%" PRIu64 ":%02" PRIu64, total / 60, total % 60);
+	}
+
+	return buffer;
+}
+
+progress_reporter::progress_reporter(const removal_scheduler &scheduler, const progress_options &options, const std::string &phase)
+	: m_scheduler(scheduler),
+	m_options(options),
+	m_phase(phase),
+	m_start(removal_scheduler::clock_type::now()),
+	m_files_per_second(0),
+	m_bytes_per_second(0),
+	m_rates_valid(false),
+	m_finishing(false),
+	m_completed(false)
+{
+	m_options.status_line = m_options.status_line && isatty(STDERR_FILENO);
+
+	m_previous.time = m_start;
+	m_previous.statistics = m_scheduler.statistics();
+
+	if (m_options.status_line || (m_options.fd >= 0))
+	{
+		m_thread = std::thread(&progress_reporter::reporter, this);
+	}
+}
+
+progress_reporter::~progress_reporter()
+{
+	finish(false);
+}
+
+void progress_reporter::finish(bool completed)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_finishing)
+		{
+			return;
+		}
+
+		m_finishing = true;
+		m_completed = completed;
+	}
+
+	m_cond.notify_all();
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+void progress_reporter::reporter()
+{
+	// Reader of records going away must not kill whole process in the middle of removal,
+	// so write() fails with EPIPE instead in this thread
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	auto interval = (m_options.status_line ? status_line_interval : record_interval);
+	auto last_record = m_start;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (!m_cond.wait_for(lock, interval, [this]() { return m_finishing; }))
+	{
+		sample current;
+		current.time = removal_scheduler::clock_type::now();
+		current.statistics = m_scheduler.statistics();
+
+		update_rates(current);
+
+		if (m_options.status_line)
+		{
+			draw_status_line(current);
+		}
+
+		if ((m_options.fd >= 0) && (current.time - last_record >= record_interval))
+		{
+			write_record(current, "running");
+			last_record = current.time;
+		}
+	}
+
+	sample current;
+	current.time = removal_scheduler::clock_type::now();
+	current.statistics = m_scheduler.statistics();
+
+	update_rates(current);
+
+	if (m_options.status_line)
+	{
+		// status line is removed, summary is printed by caller
+		fprintf(stderr, "\r\033[K");
+		fflush(stderr);
+	}
+
+	if (m_options.fd >= 0)
+	{
+		write_record(current, m_completed ? "completed" : "stopped");
+	}
+}
+
+void progress_reporter::update_rates(const sample &current)
+{
+	double seconds = std::chrono::duration<double>(current.time - m_previous.time).count();
+
+	if (seconds <= 0)
+	{
+		return;
+	}
+
+	double files_per_second = (current.statistics.files_removed - m_previous.statistics.files_removed) / seconds;
+	double bytes_per_second = (current.statistics.bytes_removed - m_previous.statistics.bytes_removed) / seconds;
+
+	if (m_rates_valid)
+	{
+		m_files_per_second += rate_smoothing * (files_per_second - m_files_per_second);
+		m_bytes_per_second += rate_smoothing * (bytes_per_second - m_bytes_per_second);
+	}
+	else
+	{
+		m_files_per_second = files_per_second;
+		m_bytes_per_second = bytes_per_second;
+		m_rates_valid = true;
+	}
+
+	m_previous = current;
+}
+
+// Returns negative value if it's unknown yet
+double progress_reporter::eta_seconds(const sample &current) const
+{
+	uint64_t done = current.statistics.files_removed + current.statistics.failures;
+	uint64_t left = (current.statistics.files_found > done) ? (current.statistics.files_found - done) : 0;
+
+	if (left == 0)
+	{
+		return 0;
+	}
+
+	if ((!m_rates_valid) || (m_files_per_second < 0.5))
+	{
+		return -1;
+	}
+
+	return left / m_files_per_second;
+}
+
+void progress_reporter::draw_status_line(const sample &current)
+{
+	const removal_statistics &statistics = current.statistics;
+	double eta = eta_seconds(current);
+
+	fprintf(stderr, "\r\033[K%s: %" PRIu64 "/%" PRIu64 " files (%.0f%%), %s/%s, %.0f files/s, %s/s, ETA %s",
+		m_phase.c_str(),
+		statistics.files_removed, statistics.files_found,
+		(statistics.files_found > 0) ? (100.0 * statistics.files_removed / statistics.files_found) : 0.0,
+		format_size(statistics.bytes_removed).c_str(), format_size(statistics.bytes_found).c_str(),
+		m_files_per_second, format_size((uint64_t) m_bytes_per_second).c_str(),
+		(eta >= 0) ? format_duration(eta).c_str() : "unknown");
+	fflush(stderr);
+}
+
+// Each record is single line of "key=value" pairs written with single write() call
+void progress_reporter::write_record(const sample &current, const char *state)
+{
+	const removal_statistics &statistics = current.statistics;
+
+	char buffer[512];
+	int length = snprintf(buffer, sizeof(buffer),
+		"phase=%s state=%s elapsed=%.3f files_found=%" PRIu64 " bytes_found=%" PRIu64 " files_removed=%" PRIu64 " bytes_removed=%" PRIu64
+		" directories_removed=%" PRIu64 " failures=%" PRIu64 " files_per_second=%.1f bytes_per_second=%.0f eta_seconds=%.1f\n",
+		m_phase.c_str(), state, std::chrono::duration<double>(current.time - m_start).count(),
+		statistics.files_found, statistics.bytes_found, statistics.files_removed, statistics.bytes_removed,
+		statistics.directories_removed, statistics.failures, m_files_per_second, m_bytes_per_second, eta_seconds(current));
+
+	if ((length > 0) && ((size_t) length < sizeof(buffer)))
+	{
+		// records are dropped if reader is slow, and not written anymore if it's gone
+		if ((write(m_options.fd, buffer, length) < 0) && (errno != EINTR) && (errno != EAGAIN))
+		{
+			m_options.fd = -1;
+		}
+	}
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DT_KERNEL_CLEANER_PROGRESS_H
+#define DT_KERNEL_CLEANER_PROGRESS_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "removal.h"
+
+struct progress_options
+{
+	// redrawn status line on stderr, only if it's a terminal
+	bool status_line = false;
+	// machine-readable records, -1 if disabled
+	int fd = -1;
+};
+
+// Reports progress of removal from its own thread using counters which scheduler updates anyway,
+// so removal itself does no extra work. Totals grow while directory trees are being scanned,
+// so percentage and ETA are estimates for what's found so far
+class progress_reporter
+{
+public:
+	progress_reporter(const removal_scheduler &scheduler, const progress_options &options, const std::string &phase);
+	~progress_reporter();
+
+	progress_reporter(const progress_reporter &other) = delete;
+	progress_reporter& operator=(const progress_reporter &other) = delete;
+
+	// Stops reporting, removes status line and writes final record
+	void finish(bool completed);
+
+private:
+	struct sample
+	{
+		removal_scheduler::clock_type::time_point time;
+		removal_statistics statistics;
+	};
+
+	void reporter();
+	void update_rates(const sample &current);
+	double eta_seconds(const sample &current) const;
+	void draw_status_line(const sample &current);
+	void write_record(const sample &current, const char *state);
+
+	const removal_scheduler &m_scheduler;
+	progress_options m_options;
+	std::string m_phase;
+	removal_scheduler::clock_type::time_point m_start;
+
+	// smoothed removal rates
+	sample m_previous;
+	double m_files_per_second;
+	double m_bytes_per_second;
+	bool m_rates_valid;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_finishing;
+	bool m_completed;
+	std::thread m_thread;
+};
+
+#endif /* DT_KERNEL_CLEANER_PROGRESS_H */
@@ -0,0 +1,1494 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "removal.h"
+
+#include "archive.h"
+#include "probes.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <exception>
+#include <list>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+void find_all_files_and_dirs(const std::string &location, std::map<std::string, uint64_t> &files, std::set<std::string> &directories)
+{
+	struct stat buffer;
+
+	if (lstat(location.c_str(), &buffer) != -1)
+	{
+		if (S_ISDIR(buffer.st_mode))
+		{
+			DIR *dirp;
+
+			directories.insert(location);
+
+			if ((dirp = opendir(location.c_str())) != NULL)
+			{
+				try
+				{
+					struct dirent *dp;
+
+					do
+					{
+						if ((dp = readdir(dirp)) != NULL)
+						{
+							if ((strcmp(dp->d_name, ".") != 0) && (strcmp(dp->d_name, "..") != 0))
+							{
+								find_all_files_and_dirs(location + "/" + std::string(dp->d_name), files, directories);
+							}
+						}
+					} while (dp != NULL);
+				}
+				catch (...)
+				{
+					closedir(dirp);
+					throw;
+				}
+
+				closedir(dirp);
+			}
+			else
+			{
+				DT_KERNEL_CLEANER_PROBE2(tree_scan_error, location.c_str(), errno);
+			}
+		}
+		else /* if (S_ISREG(buffer.st_mode) || S_ISLNK(buffer.st_mode)) */
+		{
+			files[location] = static_cast<uint64_t>(buffer.st_blocks) * 512;
+		}
+	}
+}
+
+// Objects of kernel build which are linked into external modules, relative to source tree root
+static const char* const external_build_objects[] = {
+	"arch/arm64/kernel/ftrace-mod.o",
+	"arch/powerpc/lib/crtsavres.o"
+};
+
+static bool is_external_build_object(const std::string &directory, const char *name)
+{
+	size_t name_length = strlen(name);
+
+	for (size_t i = 0; i < sizeof(external_build_objects) / sizeof(external_build_objects[0]); ++i)
+	{
+		const char *object = external_build_objects[i];
+		size_t object_length = strlen(object);
+
+		// path is compared with directory separator before it, so that "lib/crtsavres.o" doesn't match "arch/powerpc/lib/crtsavres.o"
+		if ((object_length <= name_length) || (object[object_length - name_length - 1] != '/') || (strcmp(object + object_length - name_length, name) != 0))
+		{
+			continue;
+		}
+
+		size_t prefix_length = object_length - name_length - 1;
+
+		if ((directory.length() > prefix_length)
+			&& (directory[directory.length() - prefix_length - 1] == '/')
+			&& (directory.compare(directory.length() - prefix_length, prefix_length, object, prefix_length) == 0))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Build output of kernel which is not needed for building external modules.
+// .config, Module.symvers, generated headers and objects from external_build_objects must never match
+static bool is_build_artifact(const std::string &directory, const char *name)
+{
+	static const char* const suffixes[] = { ".o", ".ko", ".cmd" };
+	static const char prefix[] = ".tmp_";
+
+	if ((strcmp(name, ".config") == 0) || (strcmp(name, "Module.symvers") == 0))
+	{
+		return false;
+	}
+
+	if (strncmp(name, prefix, sizeof(prefix) - 1) == 0)
+	{
+		return true;
+	}
+
+	size_t length = strlen(name);
+
+	for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i)
+	{
+		size_t suffix_length = strlen(suffixes[i]);
+
+		if ((length > suffix_length) && (memcmp(name + length - suffix_length, suffixes[i], suffix_length) == 0))
+		{
+			return !is_external_build_object(directory, name);
+		}
+	}
+
+	return false;
+}
+
+void find_build_artifacts(const std::string &directory, std::map<std::string, uint64_t> &files, std::set<std::string> &artifact_directories, std::set<std::string> &subdirectories)
+{
+	DIR *dirp = opendir(directory.c_str());
+
+	if (dirp == NULL)
+	{
+		DT_KERNEL_CLEANER_PROBE2(tree_scan_error, directory.c_str(), errno);
+		return;
+	}
+
+	try
+	{
+		struct dirent *dp;
+
+		while ((dp = readdir(dirp)) != NULL)
+		{
+			if ((strcmp(dp->d_name, ".") == 0) || (strcmp(dp->d_name, "..") == 0))
+			{
+				continue;
+			}
+
+			bool matched = is_build_artifact(directory, dp->d_name);
+			unsigned char type = dp->d_type;
+			struct stat buffer;
+
+			// file type is only needed for directories and for matched files, and size only for matched files
+			if ((type == DT_UNKNOWN) || matched)
+			{
+				if (fstatat(dirfd(dirp), dp->d_name, &buffer, AT_SYMLINK_NOFOLLOW) == -1)
+				{
+					continue;
+				}
+
+				type = (S_ISDIR(buffer.st_mode) ? DT_DIR : DT_REG);
+			}
+
+			if (type == DT_DIR)
+			{
+				if (matched)
+				{
+					artifact_directories.insert(directory + "/" + dp->d_name);
+				}
+				else
+				{
+					subdirectories.insert(directory + "/" + dp->d_name);
+				}
+			}
+			else if (matched)
+			{
+				files[directory + "/" + dp->d_name] = static_cast<uint64_t>(buffer.st_blocks) * 512;
+			}
+		}
+	}
+	catch (...)
+	{
+		closedir(dirp);
+		throw;
+	}
+
+	closedir(dirp);
+}
+
+bool remove_file(const std::string &file)
+{
+	DT_KERNEL_CLEANER_PROBE1(unlink_start, file.c_str());
+
+	if (unlink(file.c_str()) < 0)
+	{
+		DT_KERNEL_CLEANER_PROBE2(unlink_error, file.c_str(), errno);
+		fprintf(stderr, "Failed to remove file: %s\n", file.c_str());
+		return false;
+	}
+
+	DT_KERNEL_CLEANER_PROBE1(unlink_end, file.c_str());
+	return true;
+}
+
+bool remove_directory(const std::string &directory)
+{
+	DT_KERNEL_CLEANER_PROBE1(rmdir_start, directory.c_str());
+
+	if (rmdir(directory.c_str()) < 0)
+	{
+		DT_KERNEL_CLEANER_PROBE2(rmdir_error, directory.c_str(), errno);
+		fprintf(stderr, "Failed to remove directory: %s\n", directory.c_str());
+		return false;
+	}
+
+	DT_KERNEL_CLEANER_PROBE1(rmdir_end, directory.c_str());
+	return true;
+}
+
+bool sync_filesystem(const std::string &directory)
+{
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if ((fd < 0) || (syncfs(fd) < 0))
+	{
+		fprintf(stderr, "Failed to sync filesystem containing directory: %s\n", directory.c_str());
+
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+
+		return false;
+	}
+
+	close(fd);
+	return true;
+}
+
+removal_statistics& removal_statistics::operator+=(const removal_statistics &other)
+{
+	files_found += other.files_found;
+	bytes_found += other.bytes_found;
+	files_removed += other.files_removed;
+	bytes_removed += other.bytes_removed;
+	directories_removed += other.directories_removed;
+	failures += other.failures;
+	syncs += other.syncs;
+	sync_microseconds += other.sync_microseconds;
+
+	return *this;
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// Removal modifies directory containing the file, so if file itself is missing, use device of that directory
+static std::string get_parent_directory(const std::string &path)
+{
+	size_t pos = path.rfind('/');
+
+	if ((pos == std::string::npos) || (pos == 0))
+	{
+		return std::string("/");
+	}
+
+	return path.substr(0, pos);
+}
+
+static dev_t get_device(const std::string &path, std::optional<uint64_t> *size = NULL)
+{
+	struct stat buffer;
+
+	if (lstat(path.c_str(), &buffer) != -1)
+	{
+		if (size != NULL)
+		{
+			*size = static_cast<uint64_t>(buffer.st_blocks) * 512;
+		}
+
+		return buffer.st_dev;
+	}
+
+	if (stat(get_parent_directory(path).c_str(), &buffer) != -1)
+	{
+		return buffer.st_dev;
+	}
+
+	return 0;
+}
+
+removal_scheduler::removal_scheduler(unsigned int jobs_per_device, bool sync, archive_writer *archive)
+	: m_jobs_per_device(std::min(jobs_per_device, max_jobs_per_device)),
+	m_adaptive(false),
+	m_min_jobs(m_jobs_per_device),
+	m_max_jobs(m_jobs_per_device),
+	m_sync(sync),
+	m_archive(archive),
+	m_threads_running(0),
+	m_threads_failed(false),
+	m_syncs(0),
+	m_sync_microseconds(0)
+{
+	add_group();
+}
+
+void removal_scheduler::set_adaptive_jobs(unsigned int min_jobs, unsigned int max_jobs)
+{
+	m_adaptive = true;
+	m_min_jobs = std::min(min_jobs, max_jobs_per_device);
+	m_max_jobs = std::min(max_jobs, max_jobs_per_device);
+}
+
+size_t removal_scheduler::add_group()
+{
+	m_groups.emplace_back(new group_counters);
+
+	return m_groups.size() - 1;
+}
+
+void removal_scheduler::add_file(const std::string &file, size_t group, bool archive)
+{
+	std::optional<uint64_t> size;
+	dev_t device = get_device(file, &size);
+
+	if (size)
+	{
+		++(m_groups[group]->files_found);
+		m_groups[group]->bytes_found += *size;
+	}
+
+	add_operation(device, operation { operation_type::remove_file, file, std::shared_ptr<tree_state>(), { file_entry { file, size.value_or(0) } }, group, archive }, get_parent_directory(file));
+}
+
+void removal_scheduler::add_tree(const std::string &directory, size_t group, bool archive)
+{
+	std::shared_ptr<tree_state> tree = std::make_shared<tree_state>();
+	tree->root = directory;
+
+	add_operation(get_device(directory), operation { operation_type::scan_tree, directory, tree, std::vector<file_entry>(), group, archive }, get_parent_directory(directory));
+}
+
+void removal_scheduler::add_prune(const std::string &directory, size_t group)
+{
+	add_operation(get_device(directory), operation { operation_type::prune_directory, directory, std::shared_ptr<tree_state>(), std::vector<file_entry>(), group }, directory);
+}
+
+void removal_scheduler::add_operation(dev_t device, operation op, const std::string &sync_directory)
+{
+	std::lock_guard<std::mutex> lock(m_queues_mutex);
+
+	std::unique_ptr<device_queue> &queue = m_queues[device];
+
+	if (!queue)
+	{
+		queue.reset(new device_queue);
+		queue->sync_directory = sync_directory;
+	}
+
+	queue->operations.push_back(std::move(op));
+	++(queue->pending);
+}
+
+bool removal_scheduler::run(const std::optional<clock_type::time_point> &deadline)
+{
+	m_deadline = deadline;
+
+	auto start = clock_type::now();
+
+	for (auto iter = m_queues.begin(); iter != m_queues.end(); ++iter)
+	{
+		device_queue &queue = *(iter->second);
+
+		queue.workers_left = 0;
+		queue.limit = m_jobs_per_device;
+		queue.active = 0;
+
+		queue.concurrency = concurrency_state();
+		queue.concurrency.start = start;
+		queue.concurrency.finish = start;
+		queue.concurrency.limit_changed = start;
+		queue.concurrency.window_start = start;
+		queue.concurrency.window_removals = queue.removals;
+		queue.concurrency.window_microseconds = queue.removal_microseconds;
+		queue.concurrency.min_limit = queue.limit;
+		queue.concurrency.max_limit = queue.limit;
+	}
+
+	m_threads_failed = false;
+	m_threads_running = 0;
+
+	// Every device gets one worker first, and workers start more of them when they take operations.
+	// Devices which get none due to limit of removal threads wait for threads of other devices
+	for (auto iter = m_queues.begin(); iter != m_queues.end(); ++iter)
+	{
+		device_queue &queue = *(iter->second);
+
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (!start_worker(queue))
+		{
+			std::lock_guard<std::mutex> threads_lock(m_threads_mutex);
+
+			if (m_threads_failed)
+			{
+				// removal is stopped and everything left is saved into checkpoint
+				request_stop();
+			}
+			else
+			{
+				m_waiting_queues.push_back(&queue);
+			}
+		}
+	}
+
+	// workers may start more workers until they finish, so threads are joined until no new ones are left
+	for (;;)
+	{
+		std::vector<std::thread> threads;
+
+		{
+			std::lock_guard<std::mutex> lock(m_threads_mutex);
+			threads.swap(m_threads);
+		}
+
+		if (threads.empty())
+		{
+			break;
+		}
+
+		for (auto iter = threads.begin(); iter != threads.end(); ++iter)
+		{
+			iter->join();
+		}
+	}
+
+	// devices which were still waiting for thread when removal was stopped
+	m_waiting_queues.clear();
+
+	for (auto iter = m_queues.begin(); iter != m_queues.end(); ++iter)
+	{
+		const device_queue &queue = *(iter->second);
+		concurrency_statistics result;
+		double seconds = std::chrono::duration<double>(queue.concurrency.finish - queue.concurrency.start).count();
+
+		result.device = iter->first;
+		result.directory = queue.sync_directory;
+		result.adaptive = m_adaptive;
+		result.final_jobs = queue.limit;
+		result.min_jobs_used = queue.concurrency.min_limit;
+		result.max_jobs_used = queue.concurrency.max_limit;
+		result.average_jobs = ((seconds > 0) ? (queue.concurrency.limit_seconds / seconds) : queue.limit);
+		result.adjustments = queue.concurrency.adjustments;
+		result.removals = queue.removals;
+		result.removal_microseconds = queue.removal_microseconds;
+		result.seconds = seconds;
+
+		m_concurrency.push_back(result);
+	}
+
+	// keep only queues with operations left due to stop
+	for (auto iter = m_queues.begin(); iter != m_queues.end(); )
+	{
+		if (iter->second->operations.empty())
+		{
+			iter = m_queues.erase(iter);
+		}
+		else
+		{
+			iter->second->pending = iter->second->operations.size();
+			++iter;
+		}
+	}
+
+	return m_queues.empty();
+}
+
+// Starts one more worker of device, unless limit of removal threads is reached or thread can't be started.
+// Called with queue mutex locked
+bool removal_scheduler::start_worker(device_queue &queue)
+{
+	std::lock_guard<std::mutex> lock(m_threads_mutex);
+
+	if (m_threads_failed || (m_threads_running >= max_removal_threads))
+	{
+		return false;
+	}
+
+	try
+	{
+		m_threads.emplace_back(&removal_scheduler::worker_thread, this, &queue);
+	}
+	catch (const std::exception &exc)
+	{
+		fprintf(stderr, "Failed to start removal thread: %s\n", exc.what());
+		m_threads_failed = true;
+		return false;
+	}
+
+	++m_threads_running;
+	++(queue.workers_left);
+
+	return true;
+}
+
+// Workers are started only for operations which may be executed now, so that idle threads aren't kept
+// up to upper bound of adaptive concurrency. If thread isn't started, device continues with workers it has.
+// Called with queue mutex locked
+void removal_scheduler::start_workers(device_queue &queue)
+{
+	size_t needed = std::min<size_t>(queue.limit, queue.active + queue.operations.size());
+
+	while (queue.workers_left < needed)
+	{
+		if (!start_worker(queue))
+		{
+			break;
+		}
+	}
+}
+
+// When device is done, its thread moves on to device which waits for worker due to limit of removal threads
+void removal_scheduler::worker_thread(device_queue *queue)
+{
+	while (queue != NULL)
+	{
+		worker(*queue);
+
+		queue = NULL;
+
+		{
+			std::lock_guard<std::mutex> lock(m_threads_mutex);
+
+			if ((!m_waiting_queues.empty()) && (!should_stop()))
+			{
+				queue = m_waiting_queues.front();
+				m_waiting_queues.pop_front();
+			}
+			else
+			{
+				--m_threads_running;
+			}
+		}
+
+		if (queue != NULL)
+		{
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			++(queue->workers_left);
+		}
+	}
+}
+
+void removal_scheduler::request_stop()
+{
+	stop_requested = 1;
+}
+
+bool removal_scheduler::should_stop() const
+{
+	return (stop_requested || (m_deadline && (clock_type::now() >= *m_deadline)));
+}
+
+void removal_scheduler::push_operations(device_queue &queue, std::deque<operation> &operations)
+{
+	std::lock_guard<std::mutex> lock(queue.mutex);
+
+	queue.pending += operations.size();
+
+	while (!operations.empty())
+	{
+		queue.operations.push_back(std::move(operations.front()));
+		operations.pop_front();
+	}
+
+	// only workers which are allowed to start operations are woken up
+	for (size_t i = queue.active; (i < queue.limit) && (i < queue.active + queue.operations.size()); ++i)
+	{
+		queue.cond.notify_one();
+	}
+
+	start_workers(queue);
+}
+
+void removal_scheduler::worker(device_queue &queue)
+{
+	std::unique_lock<std::mutex> lock(queue.mutex);
+
+	for (;;)
+	{
+		queue.cond.wait(lock, [&queue] { return ((!queue.operations.empty()) && (queue.active < queue.limit)) || (queue.pending == 0); });
+
+		// operations left in queue are kept for later, and workers waiting for free slot leave too
+		if (queue.operations.empty() || should_stop())
+		{
+			queue.cond.notify_all();
+			break;
+		}
+
+		operation op = std::move(queue.operations.front());
+		queue.operations.pop_front();
+		++(queue.active);
+
+		start_workers(queue);
+
+		lock.unlock();
+
+		try
+		{
+			execute(queue, op);
+		}
+		catch (const std::exception &exc)
+		{
+			fprintf(stderr, "Caught std::exception: %s\n", exc.what());
+		}
+		catch (...)
+		{
+			fprintf(stderr, "Caught unknown exception\n");
+		}
+
+		lock.lock();
+
+		--(queue.pending);
+		--(queue.active);
+
+		unsigned int previous_limit = queue.limit;
+
+		if (m_adaptive)
+		{
+			adjust_concurrency(queue);
+		}
+
+		// this worker takes next operation itself, so others are only needed for added slots
+		if (queue.pending == 0)
+		{
+			queue.cond.notify_all();
+		}
+		else
+		{
+			for (unsigned int i = previous_limit; i < queue.limit; ++i)
+			{
+				queue.cond.notify_one();
+			}
+		}
+	}
+
+	// last worker of device syncs it, while other devices may still be busy
+	if (--(queue.workers_left) == 0)
+	{
+		queue.concurrency.finish = clock_type::now();
+		queue.concurrency.limit_seconds += queue.limit * std::chrono::duration<double>(queue.concurrency.finish - queue.concurrency.limit_changed).count();
+
+		lock.unlock();
+
+		// archived files still waiting for archive, i.e. single files or files of trees left due to stop, are removed before sync,
+		// so they're not saved into checkpoint
+		if (m_archive != NULL)
+		{
+			remove_archived_files(queue, NULL, true);
+		}
+
+		if (m_sync && queue.modified)
+		{
+			sync_device(queue);
+		}
+	}
+}
+
+bool removal_scheduler::measure_removal(device_queue &queue, bool (*function)(const std::string&), const std::string &path)
+{
+	auto start = clock_type::now();
+	bool result = function(path);
+
+	++(queue.removals);
+	queue.removal_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+
+	return result;
+}
+
+// Called with queue locked after each operation
+void removal_scheduler::adjust_concurrency(device_queue &queue)
+{
+	static const double window_seconds = 0.1;
+	static const uint64_t window_min_removals = 16;
+	static const unsigned int hold_windows = 8;
+
+	concurrency_state &state = queue.concurrency;
+	auto now = clock_type::now();
+	double seconds = std::chrono::duration<double>(now - state.window_start).count();
+	uint64_t removals = queue.removals - state.window_removals;
+
+	if ((seconds < window_seconds) || (removals < window_min_removals))
+	{
+		return;
+	}
+
+	double throughput = removals / seconds;
+	double latency = static_cast<double>(queue.removal_microseconds - state.window_microseconds) / removals;
+
+	if ((state.baseline_latency == 0) || (latency < state.baseline_latency))
+	{
+		state.baseline_latency = latency;
+	}
+
+	if ((latency > state.baseline_latency * 2) && (throughput < state.previous_throughput) && (queue.limit > m_min_jobs))
+	{
+		// device is overloaded, i.e. requests are queued on disk or server
+		change_limit(queue, std::max(m_min_jobs, queue.limit / 2), now);
+		state.probing = false;
+		state.hold_windows = hold_windows;
+	}
+	else if (state.probing && (throughput < state.previous_throughput * 1.05))
+	{
+		// last increase didn't help, return back and stay there for a while
+		change_limit(queue, queue.limit - 1, now);
+		state.probing = false;
+		state.hold_windows = hold_windows;
+	}
+	else if (state.hold_windows > 0)
+	{
+		--(state.hold_windows);
+	}
+	else if (queue.limit < m_max_jobs)
+	{
+		change_limit(queue, queue.limit + 1, now);
+		state.probing = true;
+	}
+	else
+	{
+		state.probing = false;
+	}
+
+	state.previous_throughput = throughput;
+	state.window_start = now;
+	state.window_removals = queue.removals;
+	state.window_microseconds = queue.removal_microseconds;
+}
+
+void removal_scheduler::change_limit(device_queue &queue, unsigned int limit, const clock_type::time_point &now)
+{
+	concurrency_state &state = queue.concurrency;
+
+	state.limit_seconds += queue.limit * std::chrono::duration<double>(now - state.limit_changed).count();
+	state.limit_changed = now;
+	state.min_limit = std::min(state.min_limit, limit);
+	state.max_limit = std::max(state.max_limit, limit);
+	++(state.adjustments);
+
+	queue.limit = limit;
+}
+
+void removal_scheduler::sync_device(device_queue &queue)
+{
+	auto start = clock_type::now();
+
+	if (sync_filesystem(queue.sync_directory))
+	{
+		queue.modified = false;
+		++m_syncs;
+	}
+	else
+	{
+		++(m_groups[0]->failures);
+	}
+
+	m_sync_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+}
+
+void removal_scheduler::execute(device_queue &queue, operation &op)
+{
+	std::deque<operation> new_operations;
+
+	switch (op.type)
+	{
+	case operation_type::remove_file:
+		if (op.archive)
+		{
+			archive_file(queue, op.files.front(), op.group, std::shared_ptr<tree_state>());
+			remove_archived_files(queue, NULL, false);
+		}
+		else
+		{
+			count_removal(queue, op.group, measure_removal(queue, remove_file, op.path), op.files.front().size);
+		}
+		break;
+
+	case operation_type::scan_tree:
+		{
+			std::map<std::string, uint64_t> files;
+			std::map<std::string, std::vector<file_entry> > directory_files;
+
+			DT_KERNEL_CLEANER_PROBE1(tree_scan_start, op.path.c_str());
+
+			find_all_files_and_dirs(op.path, files, op.tree->directories);
+
+			DT_KERNEL_CLEANER_PROBE3(tree_scan_end, op.path.c_str(), files.size(), op.tree->directories.size());
+
+			for (auto iter = files.begin(); iter != files.end(); ++iter)
+			{
+				directory_files[iter->first.substr(0, iter->first.rfind('/'))].push_back(file_entry { iter->first, iter->second });
+
+				++(m_groups[op.group]->files_found);
+				m_groups[op.group]->bytes_found += iter->second;
+			}
+
+			op.tree->directories_left = directory_files.size();
+
+			if (directory_files.empty())
+			{
+				new_operations.push_back(operation { operation_type::remove_tree_directories, op.path, op.tree, std::vector<file_entry>(), op.group, op.archive });
+			}
+
+			for (auto iter = directory_files.begin(); iter != directory_files.end(); ++iter)
+			{
+				new_operations.push_back(operation { operation_type::remove_directory_files, iter->first, op.tree, std::move(iter->second), op.group, op.archive });
+			}
+		}
+		break;
+
+	case operation_type::remove_directory_files:
+		DT_KERNEL_CLEANER_PROBE2(directory_files_start, op.path.c_str(), op.files.size());
+
+		if (op.archive)
+		{
+			// files of this directory are removed later, along with files of other directories which are on disk by then
+			for (auto iter = op.files.begin(); iter != op.files.end(); ++iter)
+			{
+				archive_file(queue, *iter, op.group, op.tree);
+			}
+
+			remove_archived_files(queue, NULL, false);
+		}
+		else
+		{
+			for (auto iter = op.files.begin(); iter != op.files.end(); ++iter)
+			{
+				count_removal(queue, op.group, measure_removal(queue, remove_file, iter->path), iter->size);
+			}
+		}
+
+		DT_KERNEL_CLEANER_PROBE2(directory_files_end, op.path.c_str(), op.files.size());
+
+		// files of last directory of tree are removed, directories may be removed now
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+
+			if (--(op.tree->directories_left) == 0)
+			{
+				new_operations.push_back(operation { operation_type::remove_tree_directories, op.tree->root, op.tree, std::vector<file_entry>(), op.group, op.archive });
+			}
+		}
+		break;
+
+	case operation_type::prune_directory:
+		{
+			std::map<std::string, uint64_t> files;
+			std::set<std::string> artifact_directories;
+			std::set<std::string> subdirectories;
+
+			// subdirectories are processed by other workers while files of this one are removed
+			find_build_artifacts(op.path, files, artifact_directories, subdirectories);
+
+			for (auto iter = subdirectories.begin(); iter != subdirectories.end(); ++iter)
+			{
+				new_operations.push_back(operation { operation_type::prune_directory, *iter, std::shared_ptr<tree_state>(), std::vector<file_entry>(), op.group });
+			}
+
+			for (auto iter = artifact_directories.begin(); iter != artifact_directories.end(); ++iter)
+			{
+				std::shared_ptr<tree_state> tree = std::make_shared<tree_state>();
+				tree->root = *iter;
+
+				new_operations.push_back(operation { operation_type::scan_tree, *iter, tree, std::vector<file_entry>(), op.group });
+			}
+
+			if (!new_operations.empty())
+			{
+				push_operations(queue, new_operations);
+			}
+
+			for (auto iter = files.begin(); iter != files.end(); ++iter)
+			{
+				++(m_groups[op.group]->files_found);
+				m_groups[op.group]->bytes_found += iter->second;
+
+				count_removal(queue, op.group, measure_removal(queue, remove_file, iter->first), iter->second);
+			}
+		}
+		break;
+
+	case operation_type::remove_tree_directories:
+		{
+			// directories are archived after their contents, so that their modification time is restored on extraction
+			std::vector<bool> archived;
+
+			if (op.archive)
+			{
+				archived = archive_paths(std::vector<std::string>(op.tree->directories.rbegin(), op.tree->directories.rend()));
+
+				// directories are appended after all files of tree, so these files are on disk now too
+				remove_archived_files(queue, op.tree.get(), true);
+			}
+
+			// go in reverse order to make sure that top-most directories are removed last
+			auto dirs_end = op.tree->directories.rend();
+			size_t index = 0;
+			for (auto dirs_cur = op.tree->directories.rbegin(); dirs_cur != dirs_end; ++dirs_cur, ++index)
+			{
+				if (((!op.archive) || archived[index]) && measure_removal(queue, remove_directory, *dirs_cur))
+				{
+					++(m_groups[op.group]->directories_removed);
+					queue.modified = true;
+				}
+				else
+				{
+					++(m_groups[op.group]->failures);
+				}
+			}
+		}
+		break;
+	}
+
+	if (!new_operations.empty())
+	{
+		push_operations(queue, new_operations);
+	}
+}
+
+void removal_scheduler::count_removal(device_queue &queue, size_t group, bool removed, uint64_t size)
+{
+	if (removed)
+	{
+		queue.modified = true;
+		++(m_groups[group]->files_removed);
+		m_groups[group]->bytes_removed += size;
+	}
+	else
+	{
+		++(m_groups[group]->failures);
+	}
+}
+
+void removal_scheduler::archive_file(device_queue &queue, const file_entry &file, size_t group, const std::shared_ptr<tree_state> &tree)
+{
+	uint64_t ticket = 0;
+
+	if (!m_archive->append(file.path, ticket))
+	{
+		count_removal(queue, group, false, file.size);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(queue.mutex);
+
+	queue.archived_files.push_back(archived_file { ticket, file, group, tree });
+}
+
+// Removes archived files which are on disk already, or if wait is set, waits for archive and removes all archived files of tree.
+// If tree is not specified, it applies to all archived files
+void removal_scheduler::remove_archived_files(device_queue &queue, const tree_state *tree, bool wait)
+{
+	std::vector<archived_file> files;
+	std::optional<uint64_t> last_ticket;
+
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		for (auto iter = queue.archived_files.begin(); iter != queue.archived_files.end(); )
+		{
+			if (wait ? ((tree == NULL) || (iter->tree.get() == tree)) : m_archive->committed(iter->ticket))
+			{
+				last_ticket = std::max(iter->ticket, last_ticket.value_or(0));
+				files.push_back(std::move(*iter));
+				iter = queue.archived_files.erase(iter);
+			}
+			else
+			{
+				++iter;
+			}
+		}
+	}
+
+	bool archived = true;
+
+	if (wait && last_ticket && (!m_archive->commit(*last_ticket)))
+	{
+		fprintf(stderr, "Failed to write file: %s\n", m_archive->filename().c_str());
+		archived = false;
+	}
+
+	for (auto iter = files.begin(); iter != files.end(); ++iter)
+	{
+		count_removal(queue, iter->group, archived && measure_removal(queue, remove_file, iter->file.path), iter->file.size);
+	}
+}
+
+// Returns which of specified paths are archived and may be removed.
+// Waiting for commit once for all of them lets archive write and sync them together
+std::vector<bool> removal_scheduler::archive_paths(const std::vector<std::string> &paths)
+{
+	std::vector<bool> archived(paths.size(), false);
+	std::optional<uint64_t> last_ticket;
+
+	if (m_archive == NULL)
+	{
+		return archived;
+	}
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		uint64_t ticket = 0;
+
+		if (m_archive->append(paths[i], ticket))
+		{
+			archived[i] = true;
+		}
+
+		// even if file is not archived, part of it may be written into archive
+		last_ticket = std::max(ticket, last_ticket.value_or(0));
+	}
+
+	if (last_ticket && (!m_archive->commit(*last_ticket)))
+	{
+		fprintf(stderr, "Failed to write file: %s\n", m_archive->filename().c_str());
+		std::fill(archived.begin(), archived.end(), false);
+	}
+
+	return archived;
+}
+
+removal_statistics removal_scheduler::statistics() const
+{
+	removal_statistics result;
+
+	for (size_t group = 0; group < m_groups.size(); ++group)
+	{
+		result += statistics(group);
+	}
+
+	result.syncs = m_syncs;
+	result.sync_microseconds = m_sync_microseconds;
+
+	return result;
+}
+
+removal_statistics removal_scheduler::statistics(size_t group) const
+{
+	removal_statistics result;
+
+	result.files_found = m_groups[group]->files_found;
+	result.bytes_found = m_groups[group]->bytes_found;
+	result.files_removed = m_groups[group]->files_removed;
+	result.bytes_removed = m_groups[group]->bytes_removed;
+	result.directories_removed = m_groups[group]->directories_removed;
+	result.failures = m_groups[group]->failures;
+
+	return result;
+}
+
+const std::list<concurrency_statistics>& removal_scheduler::concurrency() const
+{
+	return m_concurrency;
+}
+
+bool removal_scheduler::has_pending() const
+{
+	return (!m_queues.empty());
+}
+
+void removal_scheduler::print_pending_summary(FILE *stream) const
+{
+	size_t single_files = 0;
+	size_t trees_not_scanned = 0;
+	size_t tree_files = 0;
+	std::set<const tree_state*> partial_trees;
+	size_t tree_directories = 0;
+	size_t directories_not_pruned = 0;
+
+	for (auto queue_iter = m_queues.begin(); queue_iter != m_queues.end(); ++queue_iter)
+	{
+		const std::deque<operation> &operations = queue_iter->second->operations;
+
+		for (auto iter = operations.begin(); iter != operations.end(); ++iter)
+		{
+			switch (iter->type)
+			{
+			case operation_type::remove_file:
+				++single_files;
+				break;
+
+			case operation_type::scan_tree:
+				++trees_not_scanned;
+				break;
+
+			case operation_type::remove_directory_files:
+			case operation_type::remove_tree_directories:
+				tree_files += iter->files.size();
+
+				if (partial_trees.insert(iter->tree.get()).second)
+				{
+					tree_directories += iter->tree->directories.size();
+				}
+				break;
+
+			case operation_type::prune_directory:
+				++directories_not_pruned;
+				break;
+			}
+		}
+	}
+
+	fprintf(stream, "Remaining: %zu files and %zu directories in %zu partially removed directory trees, %zu directory trees not scanned yet, %zu other files\n",
+		tree_files, tree_directories, partial_trees.size(), trees_not_scanned, single_files);
+
+	if (directories_not_pruned != 0)
+	{
+		fprintf(stream, "Remaining: %zu directories of kept kernel sources to remove build files from\n", directories_not_pruned);
+	}
+}
+
+// Pending operations are saved as lines of keyword and path:
+//   archive <line>   - file, tree or partial tree which is archived before removal
+//   file <path>      - single file
+//   tree <path>      - directory tree which is not scanned yet
+//   prune <path>     - directory of kept kernel sources to remove build files from, along with its subdirectories
+//   partial <path>   - partially removed directory tree, followed by its remaining directories and files:
+//   directory <path> - directory of partially removed tree
+//   contents <path>  - directory of partially removed tree with files left, followed by these files:
+//   entry <size> <path> - file left in directory of partially removed tree and space it occupies
+void removal_scheduler::save_pending(const std::string &filename) const
+{
+	const std::string temp_filename = filename + ".tmp";
+
+	// leftover of failed save, unlink() doesn't follow symlinks
+	if ((unlink(temp_filename.c_str()) < 0) && (errno != ENOENT))
+	{
+		throw std::runtime_error("Failed to remove file: " + temp_filename);
+	}
+
+	int fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Failed to create file: " + temp_filename);
+	}
+
+	FILE *file = fdopen(fd, "w");
+	if (file == NULL)
+	{
+		close(fd);
+		unlink(temp_filename.c_str());
+		throw std::runtime_error("Failed to create file: " + temp_filename);
+	}
+
+	std::map<const tree_state*, std::list<const operation*> > partial_trees;
+
+	for (auto queue_iter = m_queues.begin(); queue_iter != m_queues.end(); ++queue_iter)
+	{
+		const std::deque<operation> &operations = queue_iter->second->operations;
+
+		for (auto iter = operations.begin(); iter != operations.end(); ++iter)
+		{
+			switch (iter->type)
+			{
+			case operation_type::remove_file:
+				fprintf(file, "%sfile %s\n", iter->archive ? "archive " : "", iter->path.c_str());
+				break;
+
+			case operation_type::scan_tree:
+				fprintf(file, "%stree %s\n", iter->archive ? "archive " : "", iter->path.c_str());
+				break;
+
+			case operation_type::prune_directory:
+				fprintf(file, "prune %s\n", iter->path.c_str());
+				break;
+
+			case operation_type::remove_directory_files:
+			case operation_type::remove_tree_directories:
+				partial_trees[iter->tree.get()].push_back(&(*iter));
+				break;
+			}
+		}
+	}
+
+	for (auto tree_iter = partial_trees.begin(); tree_iter != partial_trees.end(); ++tree_iter)
+	{
+		fprintf(file, "%spartial %s\n", tree_iter->second.front()->archive ? "archive " : "", tree_iter->first->root.c_str());
+
+		for (auto iter = tree_iter->first->directories.begin(); iter != tree_iter->first->directories.end(); ++iter)
+		{
+			fprintf(file, "directory %s\n", iter->c_str());
+		}
+
+		for (auto op_iter = tree_iter->second.begin(); op_iter != tree_iter->second.end(); ++op_iter)
+		{
+			if ((*op_iter)->type == operation_type::remove_directory_files)
+			{
+				fprintf(file, "contents %s\n", (*op_iter)->path.c_str());
+
+				for (auto iter = (*op_iter)->files.begin(); iter != (*op_iter)->files.end(); ++iter)
+				{
+					fprintf(file, "entry %" PRIu64 " %s\n", iter->size, iter->path.c_str());
+				}
+			}
+		}
+	}
+
+	bool failed = (ferror(file) != 0) || (fflush(file) != 0) || (m_sync && (fsync(fileno(file)) != 0));
+
+	if ((fclose(file) != 0) || failed || (rename(temp_filename.c_str(), filename.c_str()) != 0))
+	{
+		unlink(temp_filename.c_str());
+		throw std::runtime_error("Failed to write file: " + filename);
+	}
+
+	// make sure rename itself is on disk too
+	if (m_sync)
+	{
+		int fd = open(get_parent_directory(filename).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+		if ((fd < 0) || (fsync(fd) < 0))
+		{
+			fprintf(stderr, "Failed to sync directory containing file: %s\n", filename.c_str());
+		}
+
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+	}
+}
+
+// Path must be strictly inside of directory and must not contain "." or ".." components
+static bool is_path_inside(const std::string &path, const std::string &directory)
+{
+	if ((path.length() <= directory.length() + 1)
+		|| (path.compare(0, directory.length(), directory) != 0)
+		|| (path[directory.length()] != '/'))
+	{
+		return false;
+	}
+
+	size_t start = directory.length() + 1;
+
+	while (start <= path.length())
+	{
+		size_t end = path.find('/', start);
+		if (end == std::string::npos)
+		{
+			end = path.length();
+		}
+
+		const std::string component = path.substr(start, end - start);
+
+		if (component.empty() || (component == ".") || (component == ".."))
+		{
+			return false;
+		}
+
+		start = end + 1;
+	}
+
+	return true;
+}
+
+static bool is_path_inside_any(const std::string &path, const std::list<std::string> &directories)
+{
+	for (auto iter = directories.begin(); iter != directories.end(); ++iter)
+	{
+		if (is_path_inside(path, *iter))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Checkpoint is replayed before anything else, so file planted by someone else would let them remove arbitrary paths
+static std::string read_checkpoint_file(const std::string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Failed to open file: " + filename);
+	}
+
+	struct stat buffer;
+
+	if ((fstat(fd, &buffer) < 0)
+		|| (!S_ISREG(buffer.st_mode))
+		|| (buffer.st_uid != geteuid())
+		|| ((buffer.st_mode & (S_IWGRP | S_IWOTH)) != 0))
+	{
+		close(fd);
+		throw std::runtime_error("Refusing to load file which is not a regular file owned by current user and writable only by it: " + filename);
+	}
+
+	std::string result;
+	char data[65536];
+	ssize_t size;
+
+	while ((size = read(fd, data, sizeof(data))) != 0)
+	{
+		if (size < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			close(fd);
+			throw std::runtime_error("Failed to read file: " + filename);
+		}
+
+		result.append(data, size);
+	}
+
+	close(fd);
+
+	return result;
+}
+
+void removal_scheduler::load_pending(const std::string &filename, const std::list<std::string> &allowed_directories)
+{
+	std::istringstream file(read_checkpoint_file(filename));
+
+	std::shared_ptr<tree_state> tree;
+	bool tree_archive = false;
+	std::list<operation> tree_operations;
+
+	auto flush_tree = [this, &tree, &tree_archive, &tree_operations]()
+	{
+		if (tree)
+		{
+			dev_t device = get_device(tree->root);
+
+			tree->directories_left = tree_operations.size();
+
+			if (tree_operations.empty())
+			{
+				tree_operations.push_back(operation { operation_type::remove_tree_directories, tree->root, tree, std::vector<file_entry>() });
+			}
+
+			for (auto iter = tree_operations.begin(); iter != tree_operations.end(); ++iter)
+			{
+				iter->archive = tree_archive;
+				add_operation(device, std::move(*iter), get_parent_directory(tree->root));
+			}
+
+			tree.reset();
+			tree_operations.clear();
+		}
+	};
+
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		size_t pos = line.find(' ');
+		if ((pos == std::string::npos) || (pos + 1 == line.length()))
+		{
+			throw std::runtime_error("Invalid line in file " + filename + ": " + line);
+		}
+
+		std::string keyword = line.substr(0, pos);
+		std::string path = line.substr(pos + 1);
+		bool archive = false;
+
+		if (keyword == "archive")
+		{
+			if (m_archive == NULL)
+			{
+				throw std::runtime_error("Files from file " + filename + " must be archived before removal, but archive is not specified");
+			}
+
+			archive = true;
+
+			pos = path.find(' ');
+			if ((pos == std::string::npos) || (pos + 1 == path.length()))
+			{
+				throw std::runtime_error("Invalid line in file " + filename + ": " + line);
+			}
+
+			keyword = path.substr(0, pos);
+			path = path.substr(pos + 1);
+
+			if ((keyword != "file") && (keyword != "tree") && (keyword != "partial"))
+			{
+				throw std::runtime_error("Invalid line in file " + filename + ": " + line);
+			}
+		}
+
+		if ((keyword == "file") || (keyword == "tree") || (keyword == "prune") || (keyword == "partial"))
+		{
+			if (!is_path_inside_any(path, allowed_directories))
+			{
+				throw std::runtime_error("Path in file " + filename + " is outside of kernel directories of processed roots: " + path);
+			}
+		}
+		else if (((keyword == "directory") || (keyword == "contents")) && tree)
+		{
+			if ((path != tree->root) && (!is_path_inside(path, tree->root)))
+			{
+				throw std::runtime_error("Path in file " + filename + " is outside of its directory tree: " + path);
+			}
+		}
+
+		if (keyword == "file")
+		{
+			flush_tree();
+			add_file(path, 0, archive);
+		}
+		else if (keyword == "tree")
+		{
+			flush_tree();
+			add_tree(path, 0, archive);
+		}
+		else if ((keyword == "prune") && (!archive))
+		{
+			flush_tree();
+			add_prune(path);
+		}
+		else if (keyword == "partial")
+		{
+			flush_tree();
+			tree = std::make_shared<tree_state>();
+			tree->root = path;
+			tree_archive = archive;
+		}
+		else if ((keyword == "directory") && tree)
+		{
+			tree->directories.insert(path);
+		}
+		else if ((keyword == "contents") && tree)
+		{
+			tree_operations.push_back(operation { operation_type::remove_directory_files, path, tree, std::vector<file_entry>() });
+		}
+		else if ((keyword == "entry") && (!tree_operations.empty()))
+		{
+			char *endptr = NULL;
+			uint64_t size = strtoull(path.c_str(), &endptr, 10);
+
+			if ((endptr == path.c_str()) || (*endptr != ' ') || (*(endptr + 1) == '\0'))
+			{
+				throw std::runtime_error("Invalid line in file " + filename + ": " + line);
+			}
+
+			if (!is_path_inside(endptr + 1, tree_operations.back().path))
+			{
+				throw std::runtime_error("Path in file " + filename + " is outside of its directory: " + (endptr + 1));
+			}
+
+			tree_operations.back().files.push_back(file_entry { endptr + 1, size });
+
+			++(m_groups[0]->files_found);
+			m_groups[0]->bytes_found += size;
+		}
+		else
+		{
+			throw std::runtime_error("Invalid line in file " + filename + ": " + line);
+		}
+	}
+
+	flush_tree();
+}
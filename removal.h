@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2016-2021 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * This file is part of DT Kernel Cleaner.
+ *
+ * DT Kernel Cleaner is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DT Kernel Cleaner is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DT Kernel Cleaner.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DT_KERNEL_CLEANER_REMOVAL_H
+#define DT_KERNEL_CLEANER_REMOVAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// files are stored along with space they occupy on disk
+// Upper bound of parallel removals on each device, and of removal threads of all devices together
+const unsigned int max_jobs_per_device = 64;
+const unsigned int max_removal_threads = 256;
+
+void find_all_files_and_dirs(const std::string &location, std::map<std::string, uint64_t> &files, std::set<std::string> &directories);
+
+// Looks only into specified directory. Found build output files are stored along with space they occupy on disk,
+// and directories are split into directories of build output and other subdirectories to look into
+void find_build_artifacts(const std::string &directory, std::map<std::string, uint64_t> &files, std::set<std::string> &artifact_directories, std::set<std::string> &subdirectories);
+
+bool remove_file(const std::string &file);
+bool remove_directory(const std::string &directory);
+
+// Flushes filesystem containing specified directory to disk
+bool sync_filesystem(const std::string &directory);
+
+struct removal_statistics
+{
+	uint64_t files_found = 0;
+	uint64_t bytes_found = 0;
+	uint64_t files_removed = 0;
+	uint64_t bytes_removed = 0;
+	uint64_t directories_removed = 0;
+	uint64_t failures = 0;
+	uint64_t syncs = 0;
+	uint64_t sync_microseconds = 0;
+
+	removal_statistics& operator+=(const removal_statistics &other);
+};
+
+// How removal on single device was parallelized
+struct concurrency_statistics
+{
+	dev_t device = 0;
+	// any directory on device
+	std::string directory;
+
+	bool adaptive = false;
+	unsigned int final_jobs = 0;
+	unsigned int min_jobs_used = 0;
+	unsigned int max_jobs_used = 0;
+	double average_jobs = 0;
+	uint64_t adjustments = 0;
+
+	// unlink() and rmdir() calls and their total duration
+	uint64_t removals = 0;
+	uint64_t removal_microseconds = 0;
+	double seconds = 0;
+};
+
+class archive_writer;
+
+// Collects files and directory trees to remove and groups them by device they reside on.
+// Each device gets its own queue and its own set of workers, so removals on different devices don't wait for each other.
+// Directory trees are removed one directory at a time, and removal may be stopped between directories
+// due to time limit or signal. In that case whatever is left may be saved and loaded again later.
+// If sync is enabled, each modified filesystem is flushed once as soon as its queue is done.
+// With adaptive concurrency, number of workers executing operations on each device at once is adjusted
+// between specified bounds by removal throughput and latency, otherwise it's fixed.
+// Files and trees marked for archiving are appended into archive first, and are only removed after archive is on disk.
+// Archived files wait until blocks containing them are written and synced, so archive isn't flushed for every directory
+class removal_scheduler
+{
+public:
+	typedef std::chrono::steady_clock clock_type;
+
+	explicit removal_scheduler(unsigned int jobs_per_device, bool sync = false, archive_writer *archive = NULL);
+
+	removal_scheduler(const removal_scheduler &other) = delete;
+	removal_scheduler& operator=(const removal_scheduler &other) = delete;
+
+	// Each device starts with jobs_per_device workers, which must be within bounds
+	void set_adaptive_jobs(unsigned int min_jobs, unsigned int max_jobs);
+
+	// Statistics are collected separately for each group. Group 0 always exists.
+	// Groups must be added before files and trees are added from multiple threads
+	size_t add_group();
+
+	// These may be called from multiple threads
+	void add_file(const std::string &file, size_t group = 0, bool archive = false);
+	void add_tree(const std::string &directory, size_t group = 0, bool archive = false);
+	// Removes only build output from directory tree, see find_build_artifacts()
+	void add_prune(const std::string &directory, size_t group = 0);
+
+	// Removes everything queued so far and waits until it's done or until deadline is reached or stop is requested.
+	// Returns true if everything is removed
+	bool run(const std::optional<clock_type::time_point> &deadline = std::optional<clock_type::time_point>());
+
+	// May be called from signal handler
+	static void request_stop();
+
+	bool has_pending() const;
+	void print_pending_summary(FILE *stream) const;
+
+	// File is created only readable and writable by owner.
+	// It's only loaded if it's not a symlink, is owned by effective user and isn't writable by anyone else,
+	// and only if every path in it is inside one of allowed directories
+	void save_pending(const std::string &filename) const;
+	void load_pending(const std::string &filename, const std::list<std::string> &allowed_directories);
+
+	// Statistics of all groups together, including syncs
+	removal_statistics statistics() const;
+	// Statistics of single group, without syncs
+	removal_statistics statistics(size_t group) const;
+	// Devices processed by all runs so far
+	const std::list<concurrency_statistics>& concurrency() const;
+
+private:
+	struct file_entry
+	{
+		std::string path;
+		uint64_t size;
+	};
+
+	struct tree_state
+	{
+		std::string root;
+		std::set<std::string> directories;
+
+		// directories which still have files to remove
+		size_t directories_left = 0;
+	};
+
+	enum class operation_type
+	{
+		remove_file,
+		scan_tree,
+		remove_directory_files,
+		remove_tree_directories,
+		prune_directory
+	};
+
+	struct operation
+	{
+		operation_type type;
+		std::string path;
+		std::shared_ptr<tree_state> tree;
+		std::vector<file_entry> files;
+		size_t group = 0;
+		bool archive = false;
+	};
+
+	// Concurrency is increased by one while it improves throughput, and halved when removals become much slower.
+	// Decisions are made once per window of time, and after unsuccessful increase it's kept for few windows
+	struct concurrency_state
+	{
+		clock_type::time_point start;
+		clock_type::time_point finish;
+		clock_type::time_point limit_changed;
+		clock_type::time_point window_start;
+
+		// counters at start of window
+		uint64_t window_removals = 0;
+		uint64_t window_microseconds = 0;
+
+		double previous_throughput = 0;
+		double baseline_latency = 0;
+		bool probing = false;
+		unsigned int hold_windows = 0;
+
+		unsigned int min_limit = 0;
+		unsigned int max_limit = 0;
+		double limit_seconds = 0;
+		uint64_t adjustments = 0;
+	};
+
+	// File appended to archive, which is removed once archive is on disk up to its ticket
+	struct archived_file
+	{
+		uint64_t ticket;
+		file_entry file;
+		size_t group;
+		std::shared_ptr<tree_state> tree;
+	};
+
+	struct device_queue
+	{
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<operation> operations;
+
+		// queued and currently executed operations
+		size_t pending = 0;
+
+		// started workers which haven't finished yet
+		unsigned int workers_left = 0;
+
+		// workers allowed to execute operations at once, and workers executing them now
+		unsigned int limit = 0;
+		unsigned int active = 0;
+
+		std::atomic<uint64_t> removals { 0 };
+		std::atomic<uint64_t> removal_microseconds { 0 };
+
+		concurrency_state concurrency;
+
+		std::vector<archived_file> archived_files;
+
+		// any directory on device, used for syncing it
+		std::string sync_directory;
+		std::atomic<bool> modified { false };
+	};
+
+	void add_operation(dev_t device, operation op, const std::string &sync_directory);
+	void push_operations(device_queue &queue, std::deque<operation> &operations);
+	bool start_worker(device_queue &queue);
+	void start_workers(device_queue &queue);
+	void worker_thread(device_queue *queue);
+	bool should_stop() const;
+	void worker(device_queue &queue);
+	void execute(device_queue &queue, operation &op);
+	bool measure_removal(device_queue &queue, bool (*function)(const std::string&), const std::string &path);
+	void adjust_concurrency(device_queue &queue);
+	void change_limit(device_queue &queue, unsigned int limit, const clock_type::time_point &now);
+	void count_removal(device_queue &queue, size_t group, bool removed, uint64_t size);
+	std::vector<bool> archive_paths(const std::vector<std::string> &paths);
+	void archive_file(device_queue &queue, const file_entry &file, size_t group, const std::shared_ptr<tree_state> &tree);
+	void remove_archived_files(device_queue &queue, const tree_state *tree, bool wait);
+	void sync_device(device_queue &queue);
+
+	std::optional<clock_type::time_point> m_deadline;
+
+	unsigned int m_jobs_per_device;
+	bool m_adaptive;
+	unsigned int m_min_jobs;
+	unsigned int m_max_jobs;
+	bool m_sync;
+	archive_writer *m_archive;
+	std::mutex m_queues_mutex;
+	std::map<dev_t, std::unique_ptr<device_queue> > m_queues;
+
+	// threads of all devices not joined yet, workers add new ones when they take operations.
+	// Number of running threads is limited for all devices together, and devices left without thread wait for one
+	std::mutex m_threads_mutex;
+	std::vector<std::thread> m_threads;
+	unsigned int m_threads_running;
+	std::deque<device_queue*> m_waiting_queues;
+	bool m_threads_failed;
+
+	struct group_counters
+	{
+		std::atomic<uint64_t> files_found { 0 };
+		std::atomic<uint64_t> bytes_found { 0 };
+		std::atomic<uint64_t> files_removed { 0 };
+		std::atomic<uint64_t> bytes_removed { 0 };
+		std::atomic<uint64_t> directories_removed { 0 };
+		std::atomic<uint64_t> failures { 0 };
+	};
+
+	std::vector<std::unique_ptr<group_counters> > m_groups;
+
+	std::list<concurrency_statistics> m_concurrency;
+
+	std::atomic<uint64_t> m_syncs;
+	std::atomic<uint64_t> m_sync_microseconds;
+};
+
+#endif /* DT_KERNEL_CLEANER_REMOVAL_H */
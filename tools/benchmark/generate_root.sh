@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Creates system root with specified number of installed kernels for benchmarking dt-kernel-cleaner.
+# Each kernel has config, System.map, vmlinuz and initramfs in /boot, one module in /lib/modules
+# and small source tree in /usr/src. Kernel built from every fourth source tree also has ".old" files.
+# Running kernel is always 6.99.0-gentoo and it's never removed.
+#
+# USAGE: generate_root.sh COUNT DIR
+# DIR must not exist.
+
+set -e
+
+if [ $# -ne 2 ] ; then
+	echo "Usage: $0 COUNT DIR" >&2
+	exit 1
+fi
+
+count="$1"
+root="$2"
+
+if [ -e "$root" ] ; then
+	echo "Error: $root already exists" >&2
+	exit 1
+fi
+
+mkdir -p "$root/boot" "$root/lib/modules" "$root/usr/src"
+
+# versions are 5.MINOR.PATCH-gentoo, 100 patch versions per minor version
+versions()
+{
+	awk -v count="$count" 'BEGIN { for (i = 0; i < count; ++i) printf("5.%d.%d-gentoo\n", i / 100, i % 100); print "6.99.0-gentoo" }'
+}
+
+cd "$root"
+
+versions | awk '{ printf("boot/config-%s\nboot/System.map-%s\nboot/vmlinuz-%s\nboot/initramfs-%s.img\n", $1, $1, $1, $1) }' | xargs touch
+versions | awk 'NR % 4 == 0 { printf("boot/config-%s.old\nboot/System.map-%s.old\nboot/vmlinuz-%s.old\n", $1, $1, $1) }' | xargs -r touch
+versions | awk '{ printf("lib/modules/%s/kernel/drivers\nusr/src/linux-%s/include/generated\n", $1, $1) }' | xargs mkdir -p
+versions | awk '{ printf("lib/modules/%s/modules.dep\nlib/modules/%s/kernel/drivers/module.ko\nusr/src/linux-%s/.config\nusr/src/linux-%s/Makefile\nusr/src/linux-%s/include/generated/autoconf.h\n", $1, $1, $1, $1, $1) }' | xargs touch
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Measures how long it takes to find kernels and to queue their removal, i.e. "scan" phase reported by "--stats",
+# and how long removal takes, for roots with 100, 1000 and 10000 kernels.
+# Root is generated again before each run, since all kernels except running one are removed.
+#
+# USAGE: run_benchmark.sh [-n RUNS] [-d DIR] [COUNT...] [-- OPTIONS...]
+# -n RUNS - number of runs for each count of kernels, default 5
+# -d DIR - directory to generate roots in, default is temporary directory
+# OPTIONS are passed to dt-kernel-cleaner, i.e. "--jobs 4". Binary is taken from DT_KERNEL_CLEANER variable,
+# default is dt-kernel-cleaner found in PATH.
+
+set -e
+
+runs=5
+workdir=
+counts=
+tools_dir=$(dirname "$0")
+binary="${DT_KERNEL_CLEANER:-dt-kernel-cleaner}"
+
+while [ $# -gt 0 ] ; do
+	case "$1" in
+	-n)
+		runs="$2"
+		shift 2
+		;;
+	-d)
+		workdir="$2"
+		shift 2
+		;;
+	--)
+		shift
+		break
+		;;
+	*)
+		counts="$counts $1"
+		shift
+		;;
+	esac
+done
+
+if [ -z "$counts" ] ; then
+	counts="100 1000 10000"
+fi
+
+if [ -z "$workdir" ] ; then
+	workdir=$(mktemp -d)
+	trap 'rm -rf "$workdir"' EXIT
+fi
+
+printf "%8s %4s %12s %12s\n" "kernels" "run" "scan (s)" "removal (s)"
+
+for count in $counts ; do
+	run=1
+
+	while [ $run -le $runs ] ; do
+		root="$workdir/root-$count"
+		rm -rf "$root"
+		"$tools_dir/generate_root.sh" "$count" "$root"
+
+		# flush caches of generated root to disk, so that writeback doesn't affect measured run
+		sync
+
+		"$binary" --root "$root" --running-kernel 6.99.0-gentoo --clean-old --checkpoint "$workdir/checkpoint" --stats "$@" \
+			| awk -v count="$count" -v run="$run" '
+				/^\tscan phase:/ { scan = $3 }
+				/^\tremoval phase:/ { removal = $3 }
+				END { printf("%8d %4d %12s %12s\n", count, run, scan, removal) }'
+
+		run=$((run + 1))
+	done
+done
+
+rm -rf "$workdir/root-"*